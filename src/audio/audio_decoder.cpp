@@ -0,0 +1,95 @@
+#include "audio_decoder.h"
+#include <algorithm>
+
+AudioDecoder::AudioDecoder(size_t workers)
+{
+    this->stopping = false;
+    for (size_t i = 0; i < std::max<size_t>(workers, 1); i++)
+        this->workers.emplace_back(&AudioDecoder::work, this);
+}
+
+AudioDecoder::~AudioDecoder()
+{
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->condition.notify_all();
+
+    for (auto &worker : this->workers)
+        worker.join();
+}
+
+void AudioDecoder::schedule(std::shared_ptr<AudioFile> file, size_t priority)
+{
+    if (file->get_state() != AudioFileState::PENDING)
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->jobs.push_back(Job{file, priority, JobKind::LOAD});
+    }
+    this->condition.notify_one();
+}
+
+void AudioDecoder::reprioritize(const std::vector<std::shared_ptr<AudioFile>> &queue)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for (auto it = this->jobs.begin(); it != this->jobs.end();)
+    {
+        auto file = it->file.lock();
+        auto position = std::find(queue.begin(), queue.end(), file);
+
+        // Tracks that left the queue are no longer worth decoding.
+        if (file == nullptr || position == queue.end())
+        {
+            it = this->jobs.erase(it);
+            continue;
+        }
+
+        it->priority = position - queue.begin();
+        if (it->kind == JobKind::ANALYZE)
+            it->priority += AUDIO_DECODER_ANALYSIS_PRIORITY;
+        ++it;
+    }
+}
+
+void AudioDecoder::work()
+{
+    while (true)
+    {
+        std::shared_ptr<AudioFile> file;
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->condition.wait(lock, [this]
+                                 { return this->stopping || !this->jobs.empty(); });
+            if (this->stopping)
+                return;
+
+            auto next = std::min_element(this->jobs.begin(), this->jobs.end(), [](const Job &a, const Job &b)
+                                         { return a.priority < b.priority; });
+            job = *next;
+            file = job.file.lock();
+            this->jobs.erase(next);
+        }
+
+        if (file == nullptr)
+            continue;
+
+        if (job.kind == JobKind::ANALYZE)
+        {
+            file->analyze_loudness();
+            continue;
+        }
+
+        if (file->load())
+        {
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->jobs.push_back(Job{file, job.priority + AUDIO_DECODER_ANALYSIS_PRIORITY, JobKind::ANALYZE});
+            }
+            this->condition.notify_one();
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "audio_file.h"
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define AUDIO_DECODER_DEFAULT_WORKERS 2
+// Loudness analysis of a loaded track queues behind every pending load.
+#define AUDIO_DECODER_ANALYSIS_PRIORITY 1000000
+
+// Background pool that runs AudioFile::load() off the playback and
+// connection threads. Jobs with the lowest priority value run first;
+// AudioQueue uses the queue index, so the head and the next-up tracks
+// are always decoded before anything further back. Once a track has
+// loaded, its loudness analysis is queued as a low priority job.
+class AudioDecoder
+{
+public:
+    AudioDecoder(size_t workers = AUDIO_DECODER_DEFAULT_WORKERS);
+    ~AudioDecoder();
+
+    AudioDecoder(const AudioDecoder &) = delete;
+    AudioDecoder &operator=(const AudioDecoder &) = delete;
+
+    void schedule(std::shared_ptr<AudioFile> file, size_t priority);
+    void reprioritize(const std::vector<std::shared_ptr<AudioFile>> &queue);
+
+private:
+    enum class JobKind
+    {
+        LOAD,
+        ANALYZE
+    };
+
+    struct Job
+    {
+        std::weak_ptr<AudioFile> file;
+        size_t priority;
+        JobKind kind;
+    };
+
+    void work();
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::vector<Job> jobs;
+    std::vector<std::thread> workers;
+    bool stopping;
+};
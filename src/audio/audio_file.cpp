@@ -1,67 +1,385 @@
 #include "audio_file.h"
+#include "pcm_cache.h"
+#include "track_cache.h"
+#include "mix_kernels.h"
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/buffer.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
 
-AudioFile::AudioFile(const char *filename)
+static double block_duration(size_t bytes, int channels, int encoding, long rate)
 {
-    this->m_handle = mpg123_new(NULL, NULL);
-    mpg123_open(this->m_handle, filename);
-
-    mpg123_getformat(this->m_handle, &this->m_rate, &this->m_channels, &this->m_encoding);
+    size_t samples = bytes / (channels * mpg123_encsize(encoding));
+    return (double)samples / (double)rate;
+}
 
-    this->m_size = mpg123_outblock(this->m_handle);
+AudioFile::AudioFile(const char *filename, AudioFileOptions options)
+{
+    this->m_handle = NULL;
+    this->m_size = 0;
+    this->m_rate = 0;
+    this->m_channels = 0;
+    this->m_encoding = 0;
 
     this->blocks_count = 0;
     this->position = 0;
+    this->played_duration = 0;
+    this->decoded_duration = 0;
+    this->window_start = 0;
+    this->decoder_done = false;
+    this->fill_cache = false;
     this->m_filename = filename;
+    this->m_options = options;
+    this->m_state = AudioFileState::PENDING;
+    this->loudness_ready = false;
+}
+
+bool AudioFile::load()
+{
+    AudioFileState expected = AudioFileState::PENDING;
+    if (!this->m_state.compare_exchange_strong(expected, AudioFileState::LOADING))
+        return expected == AudioFileState::READY;
+
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<const DecodedTrack> track;
+
+    // The cache holds decoded PCM, which passthrough never produces.
+    if (this->m_options.cache != nullptr && !this->m_options.passthrough)
+        track = this->obtain_track("pcm-cache", [this]()
+                                   { return this->read_cached_track(); });
+
+    if (track == nullptr && this->m_options.streaming)
+    {
+        if (!this->open_decoder())
+        {
+            this->m_state = AudioFileState::FAILED;
+            return false;
+        }
+        this->fill_window();
+        // Missed the cache: play right away and let the background pass
+        // write the entry.
+        this->fill_cache = this->m_options.cache != nullptr && !this->m_options.passthrough;
+        this->finish_load(start);
+        return true;
+    }
+
+    if (track == nullptr)
+        track = this->obtain_track(this->m_options.passthrough ? "mp3" : "pcm", [this]()
+                                   { return this->decode_track(); });
+
+    if (track == nullptr)
+    {
+        std::cerr << "Could not load audio file " << this->m_filename << '\n';
+        this->m_state = AudioFileState::FAILED;
+        return false;
+    }
+
+    this->m_track = track;
+    this->m_rate = track->rate;
+    this->m_channels = track->channels;
+    this->m_encoding = track->encoding;
+    this->blocks_count = track->blocks.size();
+    this->decoded_duration = track->duration;
+    this->decoder_done = true;
+
+    this->finish_load(start);
+    return true;
+}
+
+void AudioFile::finish_load(std::chrono::steady_clock::time_point start)
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Loaded " << this->m_filename << ": " << this->blocks_count << " blocks, "
+              << (this->m_track != nullptr ? this->m_track->bytes : 0) << " bytes shared in " << elapsed / 1000.0 << " ms" << std::endl;
+    this->m_state = AudioFileState::READY;
+}
+
+std::shared_ptr<const DecodedTrack> AudioFile::obtain_track(const std::string &variant, const std::function<std::shared_ptr<const DecodedTrack>()> &load)
+{
+    if (this->m_options.tracks == nullptr)
+        return load();
+    return this->m_options.tracks->get(this->m_filename, variant, load);
+}
+
+AudioFile::~AudioFile()
+{
+    if (this->m_handle == NULL)
+        return;
+    mpg123_close(this->m_handle);
+    mpg123_delete(this->m_handle);
+}
+
+// Returns the next MPEG frame, header included, exactly as it appears in
+// the source. mpg123 only parses the frame here; nothing is decoded.
+static std::shared_ptr<AudioBlock> read_frame(mpg123_handle *handle, long &rate, int &channels, int &encoding)
+{
+    int result = mpg123_framebyframe_next(handle);
+    if (result == MPG123_NEW_FORMAT)
+        mpg123_getformat(handle, &rate, &channels, &encoding);
+    else if (result != MPG123_OK)
+        return NULL;
+
+    unsigned long header;
+    unsigned char *body;
+    size_t body_size;
+    if (mpg123_framedata(handle, &header, &body, &body_size) != MPG123_OK)
+        return NULL;
+
+    size_t size = 4 + body_size;
+    unsigned char *data = new unsigned char[size];
+    data[0] = (header >> 24) & 0xFF;
+    data[1] = (header >> 16) & 0xFF;
+    data[2] = (header >> 8) & 0xFF;
+    data[3] = header & 0xFF;
+    memcpy(data + 4, body, body_size);
+
+    auto block = std::shared_ptr<AudioBlock>(new AudioBlock(data, size, mpg123_tpf(handle), rate));
+    block->codec = AudioCodec::MP3;
+    block->channels = channels;
+    return block;
+}
+
+bool AudioFile::open_decoder()
+{
+    this->m_handle = mpg123_new(NULL, NULL);
+    if (this->m_handle == NULL || mpg123_open(this->m_handle, this->m_filename.c_str()) != MPG123_OK)
+    {
+        std::cerr << "Could not open audio file " << this->m_filename << '\n';
+        return false;
+    }
+
+    if (!this->m_options.passthrough)
+    {
+        mpg123_getformat(this->m_handle, &this->m_rate, &this->m_channels, &this->m_encoding);
+        this->m_size = mpg123_outblock(this->m_handle);
+        return true;
+    }
+
+    // The format is only known once the first frame has been parsed.
+    auto first = this->decode_block();
+    if (first == NULL)
+    {
+        std::cerr << "No MPEG frames in audio file " << this->m_filename << '\n';
+        return false;
+    }
+    this->m_blocks.push_back(first);
+    return true;
+}
+
+std::shared_ptr<AudioBlock> AudioFile::decode_block()
+{
+    if (this->decoder_done)
+        return NULL;
 
-    while (true)
+    std::shared_ptr<AudioBlock> block;
+    if (this->m_options.passthrough)
+    {
+        block = read_frame(this->m_handle, this->m_rate, this->m_channels, this->m_encoding);
+    }
+    else
     {
         unsigned char *data = new unsigned char[this->m_size];
         size_t done;
         if (mpg123_read(this->m_handle, data, this->m_size, &done) == MPG123_OK)
         {
-            size_t samples = done / (this->m_channels * mpg123_encsize(this->m_encoding));
-            double duration = (double)samples / (double)this->m_rate;
-            this->m_blocks.push_back(std::shared_ptr<AudioBlock>(new AudioBlock(data, done, duration, this->m_rate)));
-
-            this->blocks_count++;
+            double duration = block_duration(done, this->m_channels, this->m_encoding, this->m_rate);
+            block = std::shared_ptr<AudioBlock>(new AudioBlock(data, done, duration, this->m_rate));
+            block->channels = this->m_channels;
+            block->encoding = this->m_encoding;
         }
         else
-        {
             delete[] data;
-            break;
+    }
+
+    if (block == NULL)
+    {
+        this->decoder_done = true;
+        return NULL;
+    }
+
+    this->blocks_count++;
+    this->decoded_duration += block->duration;
+    return block;
+}
+
+// Eager decode of the whole track. PCM goes into a single arena; passthrough
+// frames are small and kept as they are read.
+std::shared_ptr<const DecodedTrack> AudioFile::decode_track()
+{
+    mpg123_handle *handle = mpg123_new(NULL, NULL);
+    if (handle == NULL)
+        return nullptr;
+    if (mpg123_open(handle, this->m_filename.c_str()) != MPG123_OK)
+    {
+        mpg123_delete(handle);
+        return nullptr;
+    }
+
+    auto track = std::make_shared<DecodedTrack>();
+    track->rate = 0;
+    track->channels = 0;
+    track->encoding = 0;
+    track->bytes = 0;
+    track->duration = 0;
+
+    if (this->m_options.passthrough)
+    {
+        while (auto block = read_frame(handle, track->rate, track->channels, track->encoding))
+        {
+            track->bytes += block->size;
+            track->blocks.push_back(block);
         }
     }
+    else
+    {
+        mpg123_getformat(handle, &track->rate, &track->channels, &track->encoding);
+        size_t size = mpg123_outblock(handle);
+
+        size_t estimate = AUDIO_ARENA_DEFAULT_CHUNK;
+        off_t samples = mpg123_length(handle);
+        if (samples > 0)
+            estimate = samples * track->channels * mpg123_encsize(track->encoding) + size;
+
+        auto arena = std::make_shared<AudioArena>(estimate);
+        while (true)
+        {
+            unsigned char *data = arena->reserve(size);
+            size_t done;
+            if (mpg123_read(handle, data, size, &done) != MPG123_OK)
+                break;
+
+            arena->commit(done);
+            double duration = block_duration(done, track->channels, track->encoding, track->rate);
+            auto block = AudioArena::add_block(arena, data, done, duration, track->rate);
+            block->channels = track->channels;
+            block->encoding = track->encoding;
+            track->blocks.push_back(block);
+        }
+        track->bytes = arena->bytes();
+    }
+
+    mpg123_close(handle);
+    mpg123_delete(handle);
+
+    if (this->m_options.passthrough && track->blocks.empty())
+        return nullptr;
+    track->build_index();
+    return track;
 }
 
-AudioFile::~AudioFile()
+std::shared_ptr<const DecodedTrack> AudioFile::read_cached_track()
 {
-    mpg123_close(this->m_handle);
+    auto hit = this->m_options.cache->lookup(this->m_filename);
+    if (hit == nullptr)
+    {
+        // Streaming entries start from the decoder instead of waiting for
+        // the whole file; analyze_loudness() fills the cache afterwards.
+        if (this->m_options.streaming)
+            return nullptr;
+        if (!this->decode_to_cache())
+            return nullptr;
+        hit = this->m_options.cache->lookup(this->m_filename);
+        if (hit == nullptr)
+            return nullptr;
+    }
+
+    auto track = std::make_shared<DecodedTrack>();
+    track->rate = hit->rate;
+    track->channels = hit->channels;
+    track->encoding = hit->encoding;
+    track->bytes = 0;
+    for (auto &block : hit->blocks)
+        track->bytes += block->size;
+    track->blocks = std::move(hit->blocks);
+    track->build_index();
+    return track;
+}
+
+// Decodes the whole file straight into a cache entry without keeping any
+// of it on the heap; the track is then served from the entry's mapping.
+bool AudioFile::decode_to_cache()
+{
+    mpg123_handle *handle = mpg123_new(NULL, NULL);
+    if (handle == NULL)
+        return false;
+
+    bool ok = false;
+    if (mpg123_open(handle, this->m_filename.c_str()) == MPG123_OK)
+    {
+        long rate;
+        int channels, encoding;
+        mpg123_getformat(handle, &rate, &channels, &encoding);
+
+        auto writer = this->m_options.cache->create(this->m_filename, rate, channels, encoding);
+        if (writer != nullptr)
+        {
+            std::vector<unsigned char> buffer(mpg123_outblock(handle));
+            size_t done;
+            ok = true;
+            while (ok && mpg123_read(handle, buffer.data(), buffer.size(), &done) == MPG123_OK)
+                ok = writer->append(buffer.data(), done, block_duration(done, channels, encoding, rate), rate);
+            ok = ok && writer->commit();
+        }
+        mpg123_close(handle);
+    }
+
+    mpg123_delete(handle);
+    return ok;
+}
+
+void AudioFile::fill_window()
+{
+    // Drop everything behind the play position; listeners that still hold
+    // one of those blocks keep it alive through their own shared_ptr.
+    while (this->window_start < this->position && !this->m_blocks.empty())
+    {
+        this->m_blocks.pop_front();
+        this->window_start++;
+    }
+
+    while (this->blocks_count - this->position < this->m_options.lookahead)
+    {
+        auto block = this->decode_block();
+        if (block == NULL)
+            break;
+        this->m_blocks.push_back(block);
+    }
 }
 
 std::vector<std::shared_ptr<AudioBlock>> AudioFile::fetchAudioBlocks()
 {
-    std::vector<std::shared_ptr<AudioBlock>> blocks;
-    blocks.swap(this->m_blocks);
+    if (this->m_track != nullptr)
+        return this->m_track->blocks;
+
+    std::vector<std::shared_ptr<AudioBlock>> blocks(this->m_blocks.begin(), this->m_blocks.end());
+    this->m_blocks.clear();
+    this->window_start = this->blocks_count;
     return blocks;
 }
 
 std::shared_ptr<AudioBlock> AudioFile::fetchNextAudioBlock()
 {
-    if (this->position < this->blocks_count)
-        return this->m_blocks[this->position++];
-    else
+    auto block = this->fetchCurrentAudioBlock();
+    if (block == NULL)
         return NULL;
+
+    this->position++;
+    this->played_duration += block->duration;
+    if (this->m_track == nullptr)
+        this->fill_window();
+    return block;
 }
 
 std::shared_ptr<AudioBlock> AudioFile::fetchCurrentAudioBlock()
 {
-    if (this->position < this->blocks_count)
-        return this->m_blocks[this->position];
-    else
+    if (this->m_track != nullptr)
+        return this->position < this->m_track->blocks.size() ? this->m_track->blocks[this->position] : NULL;
+
+    if (this->position < this->window_start || this->position >= this->blocks_count)
         return NULL;
+    return this->m_blocks[this->position - this->window_start];
 }
 
 AudioBlock::AudioBlock(unsigned char *data, size_t size, double duration, int sampling_rate)
@@ -70,11 +388,73 @@ AudioBlock::AudioBlock(unsigned char *data, size_t size, double duration, int sa
     this->size = size;
     this->duration = duration;
     this->sampling_rate = sampling_rate;
+    this->owns_data = true;
+}
+
+AudioBlock::AudioBlock(unsigned char *data, size_t size, double duration, int sampling_rate, std::shared_ptr<const void> storage)
+{
+    this->data = data;
+    this->size = size;
+    this->duration = duration;
+    this->sampling_rate = sampling_rate;
+    this->storage = storage;
+    this->owns_data = false;
 }
 
 AudioBlock::~AudioBlock()
 {
-    delete[] this->data;
+    if (this->owns_data)
+        delete[] this->data;
+}
+
+AudioArena::AudioArena(size_t chunk_size, std::shared_ptr<const void> backing)
+{
+    this->chunk_size = chunk_size;
+    this->chunk_used = 0;
+    this->chunk_capacity = 0;
+    this->allocated = 0;
+    this->backing = backing;
+}
+
+AudioArena::~AudioArena()
+{
+    // Teardown is the other half of what the arena saves over per-block
+    // allocations, so it is timed like the load.
+    if (this->blocks.empty())
+        return;
+
+    size_t count = this->blocks.size();
+    auto start = std::chrono::steady_clock::now();
+    this->blocks.clear();
+    this->chunks.clear();
+    this->backing.reset();
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Freed arena: " << count << " blocks, " << this->allocated << " bytes in " << elapsed / 1000.0 << " ms" << std::endl;
+}
+
+unsigned char *AudioArena::reserve(size_t size)
+{
+    if (this->chunk_capacity - this->chunk_used < size)
+    {
+        size_t capacity = std::max(this->chunk_size, size);
+        this->chunks.emplace_back(new unsigned char[capacity]);
+        this->chunk_used = 0;
+        this->chunk_capacity = capacity;
+        this->allocated += capacity;
+    }
+
+    return this->chunks.back().get() + this->chunk_used;
+}
+
+void AudioArena::commit(size_t used)
+{
+    this->chunk_used += used;
+}
+
+std::shared_ptr<AudioBlock> AudioArena::add_block(const std::shared_ptr<AudioArena> &arena, unsigned char *data, size_t size, double duration, int sampling_rate)
+{
+    AudioBlock &block = arena->blocks.emplace_back(data, size, duration, sampling_rate, nullptr);
+    return std::shared_ptr<AudioBlock>(arena, &block);
 }
 
 std::string AudioBlock::base64()
@@ -97,6 +477,49 @@ std::string AudioBlock::base64()
     return encoded;
 }
 
+std::string AudioBlock::codec_name()
+{
+    switch (this->codec)
+    {
+    case AudioCodec::MP3:
+        return "mp3";
+    case AudioCodec::OPUS:
+        return "opus";
+    default:
+        return "pcm";
+    }
+}
+
+bool AudioBlock::is_float_convertible(int encoding)
+{
+    return encoding == MPG123_ENC_SIGNED_16 || encoding == MPG123_ENC_FLOAT_32;
+}
+
+void AudioBlock::to_float(std::vector<float> &out)
+{
+    size_t samples = this->size / mpg123_encsize(this->encoding);
+    out.resize(samples);
+    if (this->encoding == MPG123_ENC_SIGNED_16)
+        mix_s16_to_f32((const int16_t *)this->data, out.data(), samples);
+    else
+        memcpy(out.data(), this->data, samples * sizeof(float));
+}
+
+std::shared_ptr<AudioBlock> AudioBlock::from_float(const float *samples, size_t count, int channels, int sampling_rate, int encoding)
+{
+    size_t size = count * mpg123_encsize(encoding);
+    unsigned char *data = new unsigned char[size];
+    if (encoding == MPG123_ENC_SIGNED_16)
+        mix_f32_to_s16(samples, (int16_t *)data, count);
+    else
+        memcpy(data, samples, size);
+
+    auto block = std::make_shared<AudioBlock>(data, size, (double)(count / channels) / sampling_rate, sampling_rate);
+    block->channels = channels;
+    block->encoding = encoding;
+    return block;
+}
+
 std::vector<unsigned char> AudioBlock::data_vector()
 {
     std::vector<unsigned char> data;
@@ -107,9 +530,176 @@ std::vector<unsigned char> AudioBlock::data_vector()
     return data;
 }
 
+void DecodedTrack::build_index()
+{
+    this->offsets.resize(this->blocks.size() + 1);
+    this->offsets[0] = 0;
+    for (size_t i = 0; i < this->blocks.size(); i++)
+        this->offsets[i + 1] = this->offsets[i] + this->blocks[i]->duration;
+    this->duration = this->offsets.back();
+}
+
+size_t DecodedTrack::block_at(double seconds) const
+{
+    if (seconds <= 0)
+        return 0;
+    // First block starting after seconds, minus one, is the one containing it.
+    auto it = std::upper_bound(this->offsets.begin(), this->offsets.end(), seconds);
+    return std::min<size_t>(it - this->offsets.begin() - 1, this->blocks.size());
+}
+
 void AudioFile::rewind()
 {
-    if (this->m_blocks.size() == 0)
-        return;
+    this->seek(0);
+}
+
+bool AudioFile::seek(double seconds)
+{
+    if (!this->is_ready())
+        return false;
+    seconds = std::max(0.0, seconds);
+
+    if (this->m_track != nullptr)
+    {
+        this->position = this->m_track->block_at(seconds);
+        this->played_duration = this->m_track->offsets[this->position];
+        return true;
+    }
+
+    // mpg123 lands on a frame boundary; the window restarts from there and
+    // counts time from the offset it actually reached.
+    double reached;
+    if (this->m_options.passthrough)
+    {
+        off_t frame = mpg123_seek_frame(this->m_handle, mpg123_timeframe(this->m_handle, seconds), SEEK_SET);
+        if (frame < 0)
+            return false;
+        reached = frame * mpg123_tpf(this->m_handle);
+    }
+    else
+    {
+        off_t sample = mpg123_seek(this->m_handle, (off_t)(seconds * this->m_rate), SEEK_SET);
+        if (sample < 0)
+            return false;
+        reached = (double)sample / this->m_rate;
+    }
+
+    this->m_blocks.clear();
+    this->blocks_count = 0;
     this->position = 0;
-}
\ No newline at end of file
+    this->played_duration = reached;
+    this->decoded_duration = reached;
+    this->window_start = 0;
+    this->decoder_done = false;
+    this->fill_window();
+    return true;
+}
+
+double AudioFile::total_duration()
+{
+    if (this->m_track != nullptr)
+        return this->m_track->duration;
+    if (this->decoder_done)
+        return this->decoded_duration;
+    if (this->m_handle == NULL || this->m_rate <= 0)
+        return -1;
+
+    off_t samples = mpg123_length(this->m_handle);
+    return samples > 0 ? (double)samples / this->m_rate : -1;
+}
+
+double AudioFile::remaining_duration()
+{
+    if (!this->decoder_done)
+        return -1;
+    return std::max(0.0, this->decoded_duration - this->played_duration);
+}
+
+void AudioFile::analyze_loudness()
+{
+    if (!this->is_ready() || this->m_options.passthrough)
+        return;
+    bool measurable = AudioBlock::is_float_convertible(this->m_encoding);
+
+    std::vector<float> samples;
+    if (this->m_track != nullptr)
+    {
+        if (!measurable)
+            return;
+
+        // Shared tracks are measured once, whichever entry gets there first.
+        if (this->m_track->loudness_claimed.exchange(true))
+            return;
+
+        LoudnessMeter meter(this->m_track->channels, this->m_track->rate);
+        for (auto &block : this->m_track->blocks)
+        {
+            block->to_float(samples);
+            meter.add(samples.data(), samples.size() / this->m_track->channels);
+        }
+        this->m_track->loudness = meter.result();
+        this->m_track->loudness_ready = true;
+        return;
+    }
+
+    // Streaming entries never hold the whole track, so decode it once more
+    // on a handle of our own, writing the cache entry on the way if the
+    // track missed it.
+    if (!measurable && !this->fill_cache)
+        return;
+    mpg123_handle *handle = mpg123_new(NULL, NULL);
+    if (handle == NULL)
+        return;
+    if (mpg123_open(handle, this->m_filename.c_str()) == MPG123_OK)
+    {
+        long rate;
+        int channels, encoding;
+        mpg123_getformat(handle, &rate, &channels, &encoding);
+
+        std::unique_ptr<PcmCacheWriter> writer;
+        if (this->fill_cache)
+            writer = this->m_options.cache->create(this->m_filename, rate, channels, encoding);
+
+        LoudnessMeter meter(channels, rate);
+        AudioBlock block(new unsigned char[mpg123_outblock(handle)], mpg123_outblock(handle), 0, rate);
+        block.channels = channels;
+        block.encoding = encoding;
+        size_t capacity = block.size;
+        size_t done;
+        while (mpg123_read(handle, block.data, capacity, &done) == MPG123_OK)
+        {
+            if (writer != nullptr && !writer->append(block.data, done, block_duration(done, channels, encoding, rate), rate))
+                writer.reset();
+            if (!measurable)
+                continue;
+            block.size = done;
+            block.to_float(samples);
+            meter.add(samples.data(), samples.size() / channels);
+        }
+        mpg123_close(handle);
+
+        if (writer != nullptr && !writer->commit())
+            std::cerr << "Could not write PCM cache entry for " << this->m_filename << '\n';
+        if (measurable)
+        {
+            this->loudness = meter.result();
+            this->loudness_ready = true;
+        }
+    }
+    mpg123_delete(handle);
+}
+
+bool AudioFile::get_loudness(LoudnessResult &result)
+{
+    if (this->m_track != nullptr && this->m_track->loudness_ready)
+    {
+        result = this->m_track->loudness;
+        return true;
+    }
+    if (this->loudness_ready)
+    {
+        result = this->loudness;
+        return true;
+    }
+    return false;
+}
@@ -3,27 +3,165 @@
 #include <mpg123.h>
 #include <memory>
 #include <vector>
+#include <deque>
 #include <iostream>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#include "loudness.h"
+
+enum class AudioCodec
+{
+    PCM,
+    MP3,
+    OPUS
+};
 
 class AudioBlock
 {
 public:
     AudioBlock(unsigned char *data, size_t size, double duration, int sampling_rate);
+    // View into memory the block does not own; storage, if set, is kept alive with the block.
+    AudioBlock(unsigned char *data, size_t size, double duration, int sampling_rate, std::shared_ptr<const void> storage);
     ~AudioBlock();
 
+    AudioBlock(const AudioBlock &) = delete;
+    AudioBlock &operator=(const AudioBlock &) = delete;
+
     unsigned char *data;
     size_t size;
     double duration;
     int sampling_rate;
+    // PCM blocks hold decoder output; MP3 blocks hold one untouched source
+    // frame; OPUS blocks hold length-prefixed packets from OpusEncoderStage.
+    AudioCodec codec = AudioCodec::PCM;
+    int channels = 0;
+    // mpg123 encoding of PCM data, 0 for compressed codecs.
+    int encoding = 0;
 
+    std::string codec_name();
     std::string base64();
+
+    // PCM in signed 16 bit or float can be converted to and from float
+    // samples for mixing and gain.
+    static bool is_float_convertible(int encoding);
+    void to_float(std::vector<float> &out);
+    static std::shared_ptr<AudioBlock> from_float(const float *samples, size_t count, int channels, int sampling_rate, int encoding);
+
     std::vector<unsigned char> data_vector();
+
+private:
+    std::shared_ptr<const void> storage;
+    bool owns_data;
+};
+
+#define AUDIO_ARENA_DEFAULT_CHUNK (4 * 1024 * 1024)
+
+// Backing store for the blocks of one track. PCM is carved out of a few
+// large chunks and the AudioBlock objects live in the arena as well.
+// Blocks are handed out as aliasing shared_ptrs, so a listener holding any
+// block keeps the whole arena alive and no block needs an allocation of
+// its own. An arena may also just keep external storage (a cache mapping)
+// alive for views into it.
+class AudioArena
+{
+public:
+    AudioArena(size_t chunk_size = AUDIO_ARENA_DEFAULT_CHUNK, std::shared_ptr<const void> backing = nullptr);
+    // Logs how long freeing the blocks, chunks and backing took.
+    ~AudioArena();
+
+    AudioArena(const AudioArena &) = delete;
+    AudioArena &operator=(const AudioArena &) = delete;
+
+    // Returns at least size contiguous bytes at the tail of the arena;
+    // commit() then keeps the first used bytes of it.
+    unsigned char *reserve(size_t size);
+    void commit(size_t used);
+
+    static std::shared_ptr<AudioBlock> add_block(const std::shared_ptr<AudioArena> &arena, unsigned char *data, size_t size, double duration, int sampling_rate);
+
+    size_t bytes() { return this->allocated; }
+
+private:
+    size_t chunk_size;
+    size_t chunk_used;
+    size_t chunk_capacity;
+    size_t allocated;
+    std::vector<std::unique_ptr<unsigned char[]>> chunks;
+    std::deque<AudioBlock> blocks;
+    std::shared_ptr<const void> backing;
 };
 
+class PcmCache;
+class TrackCache;
+
+// Decoded contents of a track. Immutable once built, so any number of queue
+// entries can play the same track at once, each with its own cursor.
+struct DecodedTrack
+{
+    long rate;
+    int channels;
+    int encoding;
+    std::vector<std::shared_ptr<AudioBlock>> blocks;
+    size_t bytes;
+    double duration;
+    // offsets[i] is the time, in seconds, at which blocks[i] starts;
+    // offsets.back() is the end of the track.
+    std::vector<double> offsets;
+
+    // Fills offsets and duration from the blocks.
+    void build_index();
+    // Index of the block playing at seconds, blocks.size() past the end.
+    size_t block_at(double seconds) const;
+
+    // Filled in by a background analysis pass once the track is decoded;
+    // read loudness only after loudness_ready is set.
+    mutable std::atomic<bool> loudness_claimed{false};
+    mutable std::atomic<bool> loudness_ready{false};
+    mutable LoudnessResult loudness;
+};
+
+// Number of decoded blocks kept ahead of the play position in streaming mode.
+// One block is a single mpg123 output block, so 256 blocks is a few seconds of audio.
+#define AUDIO_FILE_DEFAULT_LOOKAHEAD 256
+
+struct AudioFileOptions
+{
+    // Keep the decoder open and decode only a bounded window ahead of the
+    // play position instead of the whole track up front.
+    bool streaming = false;
+    size_t lookahead = AUDIO_FILE_DEFAULT_LOOKAHEAD;
+    // When set, decoded PCM is served from (and on a miss written to) this
+    // cache. Cache hits are memory-mapped, so streaming is moot for them. On
+    // a miss, a streaming entry plays from its decoder at once and the
+    // background analysis pass writes the entry; otherwise the whole track
+    // is decoded into the cache before it can play.
+    std::shared_ptr<PcmCache> cache;
+    // Emit the source MP3 frames instead of decoded PCM. mpg123 is then
+    // only used to find frame boundaries and durations.
+    bool passthrough = false;
+    // When set, fully decoded tracks are shared through this cache instead
+    // of every entry decoding its own copy. Streaming decoders are per entry.
+    std::shared_ptr<TrackCache> tracks;
+};
+
+enum class AudioFileState
+{
+    PENDING,
+    LOADING,
+    READY,
+    FAILED
+};
+
+// Construction is cheap and does no I/O; load() opens and decodes the file
+// and is normally run by an AudioDecoder worker. The format getters and the
+// fetch* methods are only meaningful once is_ready() returns true.
 class AudioFile
 {
 public:
-    AudioFile(const char *filename);
+    AudioFile(const char *filename, AudioFileOptions options = AudioFileOptions());
     ~AudioFile();
     std::vector<std::shared_ptr<AudioBlock>> fetchAudioBlocks();
     std::shared_ptr<AudioBlock> fetchNextAudioBlock();
@@ -32,17 +170,65 @@ public:
     long get_sampling_rate() { return this->m_rate; }
     int get_channels() { return this->m_channels; }
     int get_encoding() { return this->m_encoding; }
+    AudioCodec get_codec() { return this->m_options.passthrough ? AudioCodec::MP3 : AudioCodec::PCM; }
     void rewind();
+    // Moves the play position to the block containing seconds. Fully
+    // decoded tracks look it up in their index; streaming decoders seek
+    // through mpg123's frame index and decode from there.
+    bool seek(double seconds);
+    double elapsed_duration() { return this->played_duration; }
+    // Length of the track in seconds, or -1 if mpg123 cannot tell without
+    // decoding all of it.
+    double total_duration();
+    // Seconds left after the blocks fetched so far, or -1 while a streaming
+    // decoder has not reached the end of the file yet.
+    double remaining_duration();
+
+    // Measures the track's loudness and, for a streaming entry that missed
+    // the PCM cache, writes its cache entry; slow, meant for background
+    // workers.
+    void analyze_loudness();
+    // False until analyze_loudness() has finished.
+    bool get_loudness(LoudnessResult &result);
+
+    bool load();
+    AudioFileState get_state() { return this->m_state; }
+    bool is_ready() { return this->m_state == AudioFileState::READY; }
 
 private:
-    const char *m_filename;
+    std::string m_filename;
     mpg123_handle *m_handle;
     size_t m_size;
     long m_rate;
     int m_channels, m_encoding;
+    AudioFileOptions m_options;
+    std::atomic<AudioFileState> m_state;
 
     size_t blocks_count;
     size_t position;
+    double played_duration;
+    double decoded_duration;
+
+    // Loudness of a streaming entry, which has no shared track to keep it.
+    std::atomic<bool> loudness_ready;
+    LoudnessResult loudness;
+
+    // Fully decoded tracks are shared and only read through position.
+    std::shared_ptr<const DecodedTrack> m_track;
+
+    // Streaming decoder window; m_blocks.front() is block window_start.
+    size_t window_start;
+    bool decoder_done;
+    std::deque<std::shared_ptr<AudioBlock>> m_blocks;
+    // Streamed after a PCM cache miss; analyze_loudness() writes the entry.
+    bool fill_cache;
 
-    std::vector<std::shared_ptr<AudioBlock>> m_blocks;
+    std::shared_ptr<const DecodedTrack> obtain_track(const std::string &variant, const std::function<std::shared_ptr<const DecodedTrack>()> &load);
+    std::shared_ptr<const DecodedTrack> decode_track();
+    std::shared_ptr<const DecodedTrack> read_cached_track();
+    void finish_load(std::chrono::steady_clock::time_point start);
+    bool open_decoder();
+    std::shared_ptr<AudioBlock> decode_block();
+    void fill_window();
+    bool decode_to_cache();
 };
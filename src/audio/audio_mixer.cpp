@@ -0,0 +1,97 @@
+#include "audio_mixer.h"
+#include <algorithm>
+
+bool AudioMixer::should_mix(const std::shared_ptr<AudioBlock> &block, const std::shared_ptr<AudioFile> &next, double remaining)
+{
+    if (this->crossfade <= 0 || remaining < 0 || remaining >= this->crossfade)
+        return false;
+    if (block->codec != AudioCodec::PCM || !AudioBlock::is_float_convertible(block->encoding))
+        return false;
+    return next->is_ready() && next->get_codec() == AudioCodec::PCM && AudioBlock::is_float_convertible(next->get_encoding());
+}
+
+void AudioMixer::pull(size_t samples, float gain)
+{
+    std::vector<float> input;
+    std::vector<float> mapped;
+    while (this->buffer.size() < samples)
+    {
+        auto block = this->incoming->fetchNextAudioBlock();
+        if (block == nullptr)
+            break;
+        if (block->channels <= 0 || !AudioBlock::is_float_convertible(block->encoding))
+            continue;
+
+        block->to_float(input);
+        size_t frames = input.size() / block->channels;
+
+        // Map channels first (mono is duplicated, extra channels folded by
+        // index), then bring the rate over to the outgoing track's.
+        mapped.resize(frames * this->output_channels);
+        for (size_t f = 0; f < frames; f++)
+            for (int c = 0; c < this->output_channels; c++)
+                mapped[f * this->output_channels + c] = input[f * block->channels + c % block->channels];
+        if (gain != 1.0f)
+            mix_gain(mapped.data(), mapped.size(), gain);
+
+        this->resampler.configure(this->output_channels, block->sampling_rate, this->output_rate);
+        this->resampler.process(mapped.data(), frames, this->buffer);
+    }
+}
+
+std::shared_ptr<AudioBlock> AudioMixer::mix(std::shared_ptr<AudioBlock> block, std::shared_ptr<AudioFile> next, double remaining, float next_gain)
+{
+    if (this->incoming != next || block->channels != this->output_channels || block->sampling_rate != this->output_rate || block->encoding != this->output_encoding)
+    {
+        this->reset();
+        this->incoming = next;
+        this->output_channels = block->channels;
+        this->output_rate = block->sampling_rate;
+        this->output_encoding = block->encoding;
+    }
+
+    std::vector<float> outgoing;
+    block->to_float(outgoing);
+    size_t samples = outgoing.size();
+
+    this->pull(samples, next_gain);
+    if (this->buffer.size() < samples)
+        this->buffer.resize(samples, 0.0f);
+
+    // Linear ramp from the outgoing track's gain at the start of this block
+    // down to its gain at the end; the incoming track gets the complement.
+    float gain_start = std::min(1.0, (remaining + block->duration) / this->crossfade);
+    float gain_end = remaining / this->crossfade;
+    float step = samples > 0 ? (gain_start - gain_end) / samples : 0;
+
+    std::vector<float> mixed(samples);
+    mix_crossfade(outgoing.data(), this->buffer.data(), mixed.data(), samples, gain_start, step);
+    this->buffer.erase(this->buffer.begin(), this->buffer.begin() + samples);
+
+    return AudioBlock::from_float(mixed.data(), samples, this->output_channels, this->output_rate, this->output_encoding);
+}
+
+std::shared_ptr<AudioBlock> AudioMixer::flush(const std::shared_ptr<AudioFile> &head)
+{
+    if (this->incoming == nullptr)
+        return nullptr;
+
+    std::shared_ptr<AudioBlock> block;
+    if (this->incoming == head && this->buffer.size() >= (size_t)this->output_channels && this->output_channels > 0)
+    {
+        size_t samples = this->buffer.size() - this->buffer.size() % this->output_channels;
+        block = AudioBlock::from_float(this->buffer.data(), samples, this->output_channels, this->output_rate, this->output_encoding);
+    }
+
+    this->reset();
+    return block;
+}
+
+std::shared_ptr<AudioFile> AudioMixer::reset()
+{
+    auto incoming = this->incoming;
+    this->incoming = nullptr;
+    this->buffer.clear();
+    this->resampler.reset();
+    return incoming;
+}
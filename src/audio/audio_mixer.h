@@ -0,0 +1,45 @@
+#pragma once
+
+#include "audio_file.h"
+#include "mix_kernels.h"
+#include <memory>
+#include <vector>
+
+// Track transition stage used by AudioQueue. While the outgoing track is in
+// its last crossfade seconds, mix() pulls blocks from the incoming track,
+// converts them to the outgoing block's rate and channel count and fades
+// the two together. Only PCM (signed 16 bit or float) is mixed; anything
+// else is passed through and the handover is merely gapless.
+class AudioMixer
+{
+public:
+    void set_crossfade(double seconds) { this->crossfade = seconds > 0 ? seconds : 0; }
+    double get_crossfade() { return this->crossfade; }
+
+    // Whether block, with remaining seconds of its track left after it,
+    // falls in the crossfade with next.
+    bool should_mix(const std::shared_ptr<AudioBlock> &block, const std::shared_ptr<AudioFile> &next, double remaining);
+    // next_gain is the loudness normalization gain of the incoming track.
+    std::shared_ptr<AudioBlock> mix(std::shared_ptr<AudioBlock> block, std::shared_ptr<AudioFile> next, double remaining, float next_gain = 1.0f);
+
+    // Called once the outgoing track has ended and head is the new head of
+    // the queue. Returns what was already pulled from head but not played
+    // yet, so the handover loses nothing, or nullptr.
+    std::shared_ptr<AudioBlock> flush(const std::shared_ptr<AudioFile> &head);
+
+    // Drops the crossfade state and returns the track it was pulling from.
+    std::shared_ptr<AudioFile> reset();
+
+private:
+    double crossfade = 0;
+
+    std::shared_ptr<AudioFile> incoming;
+    LinearResampler resampler;
+    // Incoming samples already in the output format, not yet mixed.
+    std::vector<float> buffer;
+    int output_channels = 0;
+    int output_rate = 0;
+    int output_encoding = 0;
+
+    void pull(size_t samples, float gain);
+};
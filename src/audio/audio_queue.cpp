@@ -5,161 +5,481 @@
 #include <memory>
 #include <vector>
 #include <mutex>
-#include <condition_variable>
 #include <string>
+#include <cmath>
+#include <algorithm>
 
 #include <nlohmann/json.hpp>
 
 AudioQueue::AudioQueue()
 {
-    this->audio_block_start_time = std::chrono::high_resolution_clock::now();
+    this->clock.set_lead(AUDIO_QUEUE_DEFAULT_SEND_AHEAD_MS / 1000.0);
+    std::cout << "Mixing with " << mix_kernels_name() << " kernels" << std::endl;
+}
+
+void AudioQueue::post(std::function<void(AudioQueue &)> command)
+{
+    this->commands.push(AudioQueueCommand{std::move(command), std::chrono::steady_clock::now()});
+}
+
+void AudioQueue::apply_commands(std::chrono::steady_clock::time_point now)
+{
+    AudioQueueCommand command;
+    while (this->commands.pop(command))
+    {
+        command.apply(*this);
+
+        double latency = std::chrono::duration<double, std::micro>(now - command.posted).count();
+        this->command_stats.applied++;
+        this->command_stats.last_latency_us = latency;
+        this->command_stats.max_latency_us = std::max(this->command_stats.max_latency_us, latency);
+        this->total_command_latency_us += latency;
+        this->command_stats.mean_latency_us = this->total_command_latency_us / this->command_stats.applied;
+    }
 }
 
 void AudioQueue::push(std::shared_ptr<AudioFile> file)
 {
     this->audio_files.push_back(file);
-    this->update_listeners_queue(this->queue_info());
+    this->decoder.schedule(file, this->audio_files.size() - 1);
+    this->record({{"op", "insert"}, {"index", this->audio_files.size() - 1}, {"filename", file->get_filename()}});
+}
+
+void ListenerRegistry::add(std::shared_ptr<IAudioListener> listener)
+{
+    std::unique_lock<std::mutex> lock(this->writer);
+    auto next = this->copy_live();
+    next->push_back(listener);
+    this->publish(next);
+}
+
+void ListenerRegistry::reclaim()
+{
+    std::unique_lock<std::mutex> lock(this->writer);
+    this->publish(this->copy_live());
+}
+
+ListenerRegistry::Snapshot *ListenerRegistry::copy_live()
+{
+    auto next = new Snapshot();
+    for (auto &listener : *this->current.load())
+    {
+        if (!listener->yeet())
+            next->push_back(listener);
+    }
+    return next;
 }
 
-void AudioQueue::subscribe(std::weak_ptr<IAudioListener> listener)
+void ListenerRegistry::publish(Snapshot *next)
 {
-    this->listeners.push_back(listener);
-    listener.lock()->on_queue_change(this->queue_info());
+    this->replaced.retire(this->current.exchange(next));
+}
+
+void AudioQueue::catch_up(std::shared_ptr<IAudioListener> listener)
+{
+    this->post([listener](AudioQueue &queue)
+               { queue.send_snapshot(listener); });
+
+    // Start the client with a full buffer instead of waiting for the next tick.
+    for (auto &broadcast : this->history.recent(this->join_burst))
+        listener->on_audio_block(broadcast);
+}
+
+void AudioQueue::send_snapshot(std::shared_ptr<IAudioListener> listener)
+{
+    // Commands applied earlier this tick have changed the queue without a new
+    // version yet. Publish them first so the snapshot carries the version it
+    // shows and the end-of-tick delta does not replay them on top of it.
+    this->publish_changes();
+
+    // Built at most once per version, however many listeners join.
+    if (this->snapshot == nullptr || this->snapshot->version != this->queue_version)
+    {
+        nlohmann::json json = this->queue_info();
+        json["version"] = this->queue_version;
+        this->snapshot = std::make_shared<QueueUpdate>(this->queue_version, true, std::move(json));
+    }
+    listener->on_queue_change(this->snapshot);
+}
+
+void AudioQueue::record(nlohmann::json op)
+{
+    this->pending_ops.push_back(std::move(op));
+    this->queue_changed = true;
+}
+
+void AudioQueue::publish_changes()
+{
+    if (!this->queue_changed)
+        return;
+
+    // Every delta ends with the current state, which is small next to the
+    // file list and saves tracking which fields changed.
+    this->pending_ops.push_back({{"op", "state"}, {"metadata", this->state_info()}});
+
+    nlohmann::json json;
+    json["type"] = "queue_delta";
+    json["version"] = ++this->queue_version;
+    json["ops"] = std::move(this->pending_ops);
+    this->pending_ops = nlohmann::json::array();
+    this->queue_changed = false;
+
+    this->update_listeners_queue(std::make_shared<QueueUpdate>(this->queue_version, false, std::move(json)));
 }
 
 void AudioQueue::cplay()
 {
     this->is_playing = !this->is_playing;
     if (this->is_playing)
-        this->audio_block_start_time = std::chrono::high_resolution_clock::now();
+        this->clock.restart(std::chrono::steady_clock::now());
 
-    this->update_listeners_queue(this->queue_info());
+    this->mark_changed();
 }
 
-void AudioQueue::update()
+std::chrono::steady_clock::time_point AudioQueue::update()
 {
-    if (!this->is_playing)
-        return;
-    auto now = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - this->audio_block_start_time).count();
-    if (this->audio_files.size() == 0)
-    {
-        return;
-    }
+    auto now = std::chrono::steady_clock::now();
+    this->apply_commands(now);
+    auto deadline = this->play(now);
+    this->publish_changes();
+    return deadline;
+}
+
+std::chrono::steady_clock::time_point AudioQueue::play(std::chrono::steady_clock::time_point now)
+{
+    auto idle = now + std::chrono::milliseconds(AUDIO_QUEUE_IDLE_INTERVAL_MS);
+    if (!this->is_playing || this->audio_files.size() == 0)
+        return idle;
+
     auto file = this->audio_files[0];
-    auto current_block = file->fetchCurrentAudioBlock();
-    if (current_block == nullptr)
+    if (file->get_state() == AudioFileState::FAILED)
     {
         this->audio_files.erase(this->audio_files.begin());
-        this->update_listeners_queue(this->queue_info());
-        return;
+        this->mixer.reset();
+        this->decoder.reprioritize(this->audio_files);
+        this->record({{"op", "remove"}, {"index", 0}});
+        return now;
+    }
+
+    // The decoder has not reached this track yet: hold the clock instead of
+    // letting the wait count as played time.
+    if (!file->is_ready())
+    {
+        this->head_ready = false;
+        this->clock.restart(now);
+        return idle;
+    }
+
+    if (!this->head_ready)
+    {
+        this->head_ready = true;
+        this->mark_changed();
+    }
+
+    if (!this->clock.due(now))
+        return this->clock.deadline();
+    this->clock.tick(now);
+
+    auto block = this->next_block();
+    if (block == nullptr)
+    {
+        this->clock.restart(now);
+        return idle;
     }
 
-    if (duration >= current_block->duration * 1000)
+    if (this->output_encoder != nullptr)
+        this->update_listeners_audio(this->output_encoder->encode(block));
+    else
+        this->update_listeners_audio(block);
+    this->clock.advance(block->duration);
+    return this->clock.deadline();
+}
+
+std::shared_ptr<AudioBlock> AudioQueue::next_block()
+{
+    auto file = this->audio_files[0];
+    auto block = file->fetchNextAudioBlock();
+    if (block == nullptr)
     {
-        file->fetchNextAudioBlock();
-        auto block = file->fetchCurrentAudioBlock();
-        if (block == NULL)
+        // The head ended: hand over to the next track within the same tick
+        // so there is no gap between them.
+        this->audio_files.erase(this->audio_files.begin());
+        this->decoder.reprioritize(this->audio_files);
+        this->record({{"op", "remove"}, {"index", 0}});
+        if (this->audio_files.size() == 0)
         {
-            this->audio_files.erase(this->audio_files.begin());
-            this->update_listeners_queue(this->queue_info());
-            return;
+            this->mixer.reset();
+            return nullptr;
         }
 
-        this->update_listeners_audio(block);
-        this->audio_block_start_time = std::chrono::high_resolution_clock::now();
+        file = this->audio_files[0];
+        auto pending = this->mixer.flush(file);
+        if (pending != nullptr)
+            return pending;
+        if (!file->is_ready())
+            return nullptr;
+
+        block = file->fetchNextAudioBlock();
+        if (block == nullptr)
+            return nullptr;
     }
+
+    // Blocks are shared with the track, so gain goes into a copy.
+    float gain = this->track_gain(file);
+    if (gain != 1.0f && block->codec == AudioCodec::PCM && AudioBlock::is_float_convertible(block->encoding))
+    {
+        std::vector<float> samples;
+        block->to_float(samples);
+        mix_gain(samples.data(), samples.size(), gain);
+        block = AudioBlock::from_float(samples.data(), samples.size(), block->channels, block->sampling_rate, block->encoding);
+    }
+
+    if (this->audio_files.size() > 1)
+    {
+        auto next = this->audio_files[1];
+        double remaining = file->remaining_duration();
+        if (this->mixer.should_mix(block, next, remaining))
+            return this->mixer.mix(block, next, remaining, this->track_gain(next));
+    }
+
+    return block;
+}
+
+float AudioQueue::track_gain(const std::shared_ptr<AudioFile> &file)
+{
+    LoudnessResult loudness;
+    if (!this->normalize || !file->get_loudness(loudness) || loudness.integrated <= LOUDNESS_SILENCE)
+        return 1.0f;
+
+    // Never push the loudest sample past full scale.
+    double gain = std::pow(10.0, (this->normalize_target - loudness.integrated) / 20.0);
+    if (loudness.peak > 0)
+        gain = std::min(gain, 1.0 / loudness.peak);
+    return (float)gain;
+}
+
+// Whatever the crossfade already consumed of the incoming track is thrown
+// away, so that track starts over from its beginning.
+void AudioQueue::reset_mixer()
+{
+    auto incoming = this->mixer.reset();
+    if (incoming != nullptr)
+        incoming->rewind();
+}
+
+void AudioQueue::set_send_ahead(double ms)
+{
+    this->clock.set_lead(ms / 1000.0);
+    this->mark_changed();
+}
+
+void AudioQueue::set_crossfade(double seconds)
+{
+    this->mixer.set_crossfade(seconds);
+    this->mark_changed();
+}
+
+void AudioQueue::seek(double position)
+{
+    if (this->audio_files.size() == 0)
+        return;
+
+    this->reset_mixer();
+    if (this->audio_files[0]->seek(position / 1000.0))
+        this->mark_changed();
+}
+
+void AudioQueue::set_normalization(bool enabled, double target)
+{
+    this->normalize = enabled;
+    this->normalize_target = target;
+    this->mark_changed();
+}
+
+void AudioQueue::set_output_codec(AudioCodec codec, int bitrate)
+{
+    if (codec != AudioCodec::OPUS)
+        this->output_encoder.reset();
+    else if (this->output_encoder == nullptr)
+        this->output_encoder = std::make_unique<OpusEncoderStage>(bitrate);
+    else
+        this->output_encoder->set_bitrate(bitrate);
+
+    this->mark_changed();
+}
+
+std::shared_ptr<const std::vector<char>> AudioBroadcast::frame(size_t variant, const std::function<std::vector<char>()> &build)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (this->frames[variant] == nullptr)
+        this->frames[variant] = std::make_shared<const std::vector<char>>(build());
+    return this->frames[variant];
+}
+
+std::shared_ptr<const std::vector<char>> QueueUpdate::frame(size_t variant, const std::function<std::vector<char>()> &build)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (this->frames[variant] == nullptr)
+        this->frames[variant] = std::make_shared<const std::vector<char>>(build());
+    return this->frames[variant];
 }
 
 void AudioQueue::update_listeners_audio(std::shared_ptr<AudioBlock> block)
 {
-    for (auto it = this->listeners.begin(); it != this->listeners.end();)
-    {
-        auto listener = it->lock();
+    auto broadcast = std::make_shared<AudioBroadcast>(block, this->broadcast_sequence++, this->stream_time);
+    this->stream_time += block->duration;
+    this->history.push(broadcast);
 
-        if (listener == nullptr || listener->yeet())
+    size_t dead = 0;
+    auto snapshot = this->listeners.snapshot();
+    for (auto &listener : *snapshot)
+    {
+        if (listener->yeet())
         {
-            it = this->listeners.erase(it);
+            dead++;
             continue;
         }
-        listener->on_audio_block(block);
-        ++it;
+        listener->on_audio_block(broadcast);
     }
+
+    // Republishing copies the whole snapshot, so it waits for a batch.
+    if (dead >= LISTENER_REGISTRY_RECLAIM_BATCH)
+        this->listeners.reclaim();
+}
+
+BroadcastHistory::~BroadcastHistory()
+{
+    for (auto &slot : this->slots)
+        delete slot.load();
 }
 
-void AudioQueue::update_listeners_queue(nlohmann::json queue)
+void BroadcastHistory::push(const std::shared_ptr<AudioBroadcast> &broadcast)
 {
-    for (auto it = this->listeners.begin(); it != this->listeners.end();)
+    const Entry *previous = this->slots[broadcast->sequence % BROADCAST_HISTORY_CAPACITY].exchange(new Entry(broadcast));
+    this->end.store(broadcast->sequence + 1, std::memory_order_release);
+    if (previous != nullptr)
+        this->replaced.retire(previous);
+}
+
+std::vector<std::shared_ptr<AudioBroadcast>> BroadcastHistory::recent(double seconds)
+{
+    std::vector<std::shared_ptr<AudioBroadcast>> result;
+    EpochReclaimer<Entry>::Guard guard(this->replaced);
+    uint64_t end = this->end.load(std::memory_order_acquire);
+    uint64_t start = end > BROADCAST_HISTORY_CAPACITY ? end - BROADCAST_HISTORY_CAPACITY : 0;
+
+    double covered = 0;
+    for (uint64_t sequence = end; sequence > start && covered < seconds; sequence--)
     {
-        auto listener = it->lock();
+        const Entry *entry = this->slots[(sequence - 1) % BROADCAST_HISTORY_CAPACITY].load();
+        // The writer lapped us; everything older is gone as well.
+        if (entry == nullptr || (*entry)->sequence != sequence - 1)
+            break;
+        covered += (*entry)->block->duration;
+        result.push_back(*entry);
+    }
 
-        if (listener == nullptr || listener->yeet())
+    std::reverse(result.begin(), result.end());
+    return result;
+}
+
+void AudioQueue::update_listeners_queue(std::shared_ptr<QueueUpdate> update)
+{
+    bool dead = false;
+    auto snapshot = this->listeners.snapshot();
+    for (auto &listener : *snapshot)
+    {
+        if (listener->yeet())
         {
-            it = this->listeners.erase(it);
+            dead = true;
             continue;
         }
-
-        listener->on_queue_change(queue);
-        ++it;
+        listener->on_queue_change(update);
     }
+
+    // Queue changes are rare enough to clean up after every one.
+    if (dead)
+        this->listeners.reclaim();
 }
 
 nlohmann::json AudioQueue::queue_info()
 {
     nlohmann::json json;
-    json["metadata"]["is_playing"] = this->is_playing;
-    json["metadata"]["queue"]["size"] = this->audio_files.size();
+    json["metadata"] = this->state_info();
     json["metadata"]["queue"]["files"] = nlohmann::json::array();
     for (int i = 0; i < this->audio_files.size(); i++)
     {
         json["metadata"]["queue"]["files"][i] = this->audio_files[i]->get_filename();
     }
+    return json;
+}
+
+nlohmann::json AudioQueue::state_info()
+{
+    nlohmann::json json;
+    json["station"] = this->station_name;
+    json["is_playing"] = this->is_playing;
+    json["crossfade"] = this->mixer.get_crossfade();
+    PlaybackClockStats clock = this->clock.stats();
+    json["clock"]["send_ahead"] = this->clock.get_lead() * 1000.0;
+    json["clock"]["ticks"] = clock.ticks;
+    json["clock"]["resyncs"] = clock.resyncs;
+    json["clock"]["jitter_us"]["last"] = clock.last_jitter_us;
+    json["clock"]["jitter_us"]["mean"] = clock.mean_jitter_us;
+    json["clock"]["jitter_us"]["max"] = clock.max_jitter_us;
+    json["commands"]["applied"] = this->command_stats.applied;
+    json["commands"]["latency_us"]["last"] = this->command_stats.last_latency_us;
+    json["commands"]["latency_us"]["mean"] = this->command_stats.mean_latency_us;
+    json["commands"]["latency_us"]["max"] = this->command_stats.max_latency_us;
+    json["output"]["codec"] = this->output_encoder != nullptr ? "opus" : "pcm";
+    if (this->output_encoder != nullptr)
+        json["output"]["bitrate"] = this->output_encoder->get_bitrate();
+    json["normalization"]["enabled"] = this->normalize;
+    json["normalization"]["target"] = this->normalize_target;
+    json["queue"]["size"] = this->audio_files.size();
+
+    if (this->file_options.tracks != nullptr)
+    {
+        TrackCacheStats stats = this->file_options.tracks->stats();
+        json["track_cache"]["hits"] = stats.hits;
+        json["track_cache"]["misses"] = stats.misses;
+        json["track_cache"]["evictions"] = stats.evictions;
+        json["track_cache"]["bytes"] = stats.bytes;
+        json["track_cache"]["tracks"] = stats.tracks;
+    }
 
     if (this->audio_files.size() == 0)
         return json;
 
     auto file = this->audio_files[0];
-    json["metadata"]["current"]["filename"] = file->get_filename();
-    json["metadata"]["current"]["sampling_rate"] = file->get_sampling_rate();
-    json["metadata"]["current"]["channels"] = file->get_channels();
-    json["metadata"]["current"]["encoding"] = file->get_encoding();
-
-    return json;
-}
+    json["current"]["filename"] = file->get_filename();
+    json["current"]["ready"] = file->is_ready();
+    if (!file->is_ready())
+        return json;
 
-void AudioQueueRwLock::lock_write()
-{
-    std::unique_lock<std::mutex> lock(this->mutex);
-    this->write_condition.wait(lock, [this]
-                               { return !this->writer && this->readers == 0; });
-    this->writer = true;
-}
+    json["current"]["sampling_rate"] = file->get_sampling_rate();
+    json["current"]["channels"] = file->get_channels();
+    json["current"]["encoding"] = file->get_encoding();
+    json["current"]["codec"] = file->get_codec() == AudioCodec::MP3 ? "mp3" : "pcm";
 
-void AudioQueueRwLock::unlock_write()
-{
-    std::unique_lock<std::mutex> lock(this->mutex);
-    this->writer = false;
-    this->read_condition.notify_all();
-    this->write_condition.notify_one();
-}
+    // Milliseconds; remaining is -1 while the length is unknown.
+    double elapsed = file->elapsed_duration();
+    double total = file->total_duration();
+    json["current"]["position"]["elapsed"] = elapsed * 1000.0;
+    json["current"]["position"]["remaining"] = total < 0 ? -1.0 : std::max(0.0, total - elapsed) * 1000.0;
 
-void AudioQueueRwLock::lock_read()
-{
-    std::unique_lock<std::mutex> lock(this->mutex);
-    this->read_condition.wait(lock, [this]
-                              { return !this->writer; });
-    this->readers++;
-}
+    LoudnessResult loudness;
+    if (file->get_loudness(loudness))
+    {
+        json["current"]["loudness"] = loudness.integrated;
+        json["current"]["peak"] = loudness.peak;
+        json["current"]["gain"] = this->track_gain(file);
+    }
 
-void AudioQueueRwLock::unlock_read()
-{
-    std::unique_lock<std::mutex> lock(this->mutex);
-    this->readers--;
-    if (this->readers == 0)
-        this->write_condition.notify_one();
+    return json;
 }
 
-AudioQueue &AudioQueueRwLock::get_queue()
+AudioQueue &Station::get_queue()
 {
     return this->queue;
 }
@@ -169,8 +489,10 @@ void AudioQueue::skip_audio_file(int index)
     if (index < 0 || index >= this->audio_files.size())
         return;
 
+    this->reset_mixer();
     this->audio_files.erase(this->audio_files.begin() + index);
-    this->update_listeners_queue(this->queue_info());
+    this->decoder.reprioritize(this->audio_files);
+    this->record({{"op", "remove"}, {"index", index}});
 }
 
 void AudioQueue::swap_audio_files(int index1, int index2)
@@ -181,6 +503,14 @@ void AudioQueue::swap_audio_files(int index1, int index2)
         return;
     if (index1 == index2)
         return;
+    this->reset_mixer();
     std::swap(this->audio_files[index1], this->audio_files[index2]);
-    this->update_listeners_queue(this->queue_info());
+    this->decoder.reprioritize(this->audio_files);
+
+    // A move takes the file out at from and puts it back in at to, so a
+    // swap is the lower one moved up and the upper one moved down.
+    int low = std::min(index1, index2);
+    int high = std::max(index1, index2);
+    this->record({{"op", "move"}, {"from", low}, {"to", high}});
+    this->record({{"op", "move"}, {"from", high - 1}, {"to", low}});
 }
\ No newline at end of file
@@ -1,67 +1,282 @@
 #pragma once
 
 #include "audio_file.h"
+#include "audio_decoder.h"
+#include "opus_encoder_stage.h"
+#include "track_cache.h"
+#include "audio_mixer.h"
+#include "playback_clock.h"
 #include <chrono>
 #include <functional>
 #include <memory>
 #include <vector>
 #include <mutex>
-#include <condition_variable>
 #include <string.h>
+#include <atomic>
 
 #include <nlohmann/json.hpp>
 
 #include "../server_thread_interface.hpp"
+#include "../mpsc_queue.hpp"
+#include "../epoch_reclaimer.hpp"
+
+#define AUDIO_BROADCAST_FRAME_VARIANTS 4
+// How long the playback loop sleeps when there is nothing to play, which
+// bounds how late it notices a resume or a newly ready track.
+#define AUDIO_QUEUE_IDLE_INTERVAL_MS 20
+// How far ahead of its play time a block is sent by default.
+#define AUDIO_QUEUE_DEFAULT_SEND_AHEAD_MS 500
+
+// A block as it goes through the fan-out, created once per tick. Listeners
+// that put the same wire format on the socket share its serialized frame:
+// the first listener to ask builds it and every other one writes the same
+// immutable buffer.
+class AudioBroadcast
+{
+public:
+    AudioBroadcast(std::shared_ptr<AudioBlock> block, uint64_t sequence, double timestamp) : block(block), sequence(sequence), timestamp(timestamp) {}
+
+    std::shared_ptr<const std::vector<char>> frame(size_t variant, const std::function<std::vector<char>()> &build);
+
+    const std::shared_ptr<AudioBlock> block;
+    // Position of this block in the station's output: a running block
+    // counter and the stream time, in seconds, at which the block starts.
+    const uint64_t sequence;
+    const double timestamp;
+
+private:
+    std::mutex mutex;
+    std::shared_ptr<const std::vector<char>> frames[AUDIO_BROADCAST_FRAME_VARIANTS];
+};
+
+#define BROADCAST_HISTORY_CAPACITY 1024
+// Seconds of already emitted audio a new subscriber is sent right away.
+#define BROADCAST_HISTORY_DEFAULT_BURST 2.0
+
+// Fixed ring of the most recent broadcasts, frames included, for bringing
+// late joiners up to speed. The playback loop is the only writer; readers
+// take no lock and tell an overwritten slot by its sequence number. Slots
+// point at their entries, and a replaced entry is only deleted once readers
+// that might still be copying it have left.
+class BroadcastHistory
+{
+public:
+    BroadcastHistory() = default;
+    ~BroadcastHistory();
+
+    BroadcastHistory(const BroadcastHistory &) = delete;
+    BroadcastHistory &operator=(const BroadcastHistory &) = delete;
+
+    void push(const std::shared_ptr<AudioBroadcast> &broadcast);
+    // Broadcasts covering up to the last seconds of stream time, oldest first.
+    std::vector<std::shared_ptr<AudioBroadcast>> recent(double seconds);
+
+private:
+    typedef std::shared_ptr<AudioBroadcast> Entry;
+
+    std::atomic<const Entry *> slots[BROADCAST_HISTORY_CAPACITY] = {};
+    // Sequence number one past the newest broadcast pushed.
+    std::atomic<uint64_t> end{0};
+    EpochReclaimer<Entry> replaced;
+};
+
+#define QUEUE_UPDATE_FRAME_VARIANTS 2
+
+// A versioned change to the queue, serialized once for all listeners. A
+// delta holds the operations (insert, remove, move, state) that turn
+// version - 1 into version; a snapshot holds the whole queue at version and
+// is only sent to new listeners and ones that missed a delta.
+class QueueUpdate
+{
+public:
+    QueueUpdate(uint64_t version, bool snapshot, nlohmann::json message) : version(version), snapshot(snapshot), message(std::move(message)) {}
+
+    std::shared_ptr<const std::vector<char>> frame(size_t variant, const std::function<std::vector<char>()> &build);
+
+    const uint64_t version;
+    const bool snapshot;
+    const nlohmann::json message;
+
+private:
+    std::mutex mutex;
+    std::shared_ptr<const std::vector<char>> frames[QUEUE_UPDATE_FRAME_VARIANTS];
+};
 
 class IAudioListener : public Object
 {
 public:
-    virtual void on_audio_block(std::shared_ptr<AudioBlock> block) = 0;
-    virtual void on_queue_change(nlohmann::json queue) = 0;
+    virtual void on_audio_block(std::shared_ptr<AudioBroadcast> broadcast) = 0;
+    virtual void on_queue_change(std::shared_ptr<QueueUpdate> update) = 0;
     virtual bool yeet() = 0;
 };
 
+// Dead listeners the fan-out tolerates before it republishes without them.
+#define LISTENER_REGISTRY_RECLAIM_BATCH 16
+
+// Subscribers kept as an immutable snapshot that every change replaces
+// wholesale (read-copy-update). The fan-out reads the current snapshot and
+// walks it without taking a lock; writers only serialize among themselves,
+// and a replaced snapshot is deleted once no reader is still walking it.
+// Listeners that report yeet() are skipped until a reclaim() drops them.
+class ListenerRegistry
+{
+public:
+    typedef std::vector<std::shared_ptr<IAudioListener>> Snapshot;
+
+    // The snapshot current when it was created, kept alive as long as it is.
+    class View
+    {
+    public:
+        explicit View(ListenerRegistry &registry) : guard(registry.replaced), current(registry.current.load()) {}
+
+        const Snapshot &operator*() const { return *this->current; }
+
+    private:
+        EpochReclaimer<Snapshot>::Guard guard;
+        const Snapshot *current;
+    };
+
+    ListenerRegistry() : current(new Snapshot()) {}
+    ~ListenerRegistry() { delete this->current.load(); }
+
+    ListenerRegistry(const ListenerRegistry &) = delete;
+    ListenerRegistry &operator=(const ListenerRegistry &) = delete;
+
+    void add(std::shared_ptr<IAudioListener> listener);
+    // Publishes a snapshot without the listeners that have gone away.
+    void reclaim();
+
+    View snapshot() { return View(*this); }
+
+private:
+    std::atomic<const Snapshot *> current;
+    std::mutex writer;
+    EpochReclaimer<Snapshot> replaced;
+
+    // Copies the live listeners; caller holds writer.
+    Snapshot *copy_live();
+    // Makes next current; caller holds writer.
+    void publish(Snapshot *next);
+};
+
+struct AudioQueueCommandStats
+{
+    unsigned long long applied = 0;
+    // Microseconds from post() until the playback thread applied a command.
+    double last_latency_us = 0;
+    double mean_latency_us = 0;
+    double max_latency_us = 0;
+};
+
+class AudioQueue;
+
+struct AudioQueueCommand
+{
+    std::function<void(AudioQueue &)> apply;
+    std::chrono::steady_clock::time_point posted;
+};
+
+// Owned by the thread that calls update(); everything else reaches the
+// queue through post(), except for subscribing and catching up.
 class AudioQueue
 {
 public:
     AudioQueue();
 
+    // Queues command to run on the playback thread at the start of its next
+    // update(). Safe from any thread and never blocks.
+    void post(std::function<void(AudioQueue &)> command);
+
     void push(std::shared_ptr<AudioFile> file);
-    void subscribe(std::weak_ptr<IAudioListener> listener);
-    void update();
+    // Subscribing and catching up only touch published snapshots, so they
+    // are safe from any thread and never wait for the playback tick.
+    // Listeners leave by reporting yeet().
+    void subscribe(std::shared_ptr<IAudioListener> listener) { this->listeners.add(listener); }
+    // Sends listener the join burst and, from the playback thread, a queue
+    // snapshot, e.g. when it receives the stream through a subscribed shard.
+    void catch_up(std::shared_ptr<IAudioListener> listener);
+    // Sends listener a snapshot of the current version. Playback thread only.
+    void send_snapshot(std::shared_ptr<IAudioListener> listener);
+    // Applies posted commands, emits the block that is due, if any, and
+    // returns when it should be called next.
+    std::chrono::steady_clock::time_point update();
 
     void update_listeners_audio(std::shared_ptr<AudioBlock> block);
-    void update_listeners_queue(nlohmann::json queue);
+    void update_listeners_queue(std::shared_ptr<QueueUpdate> update);
     void skip_audio_file(int index);
     void swap_audio_files(int index1, int index2);
     nlohmann::json queue_info();
     void cplay();
     void rewind();
+    // Jumps within the current track; position is in milliseconds.
+    void seek(double position);
+    // Selects the codec every listener of the station receives, so it is
+    // set by the operator rather than by clients. PCM sends blocks as
+    // decoded, OPUS encodes each block once before the fan-out.
+    void set_output_codec(AudioCodec codec, int bitrate = OPUS_STAGE_DEFAULT_BITRATE);
+    void set_station_name(const std::string &name) { this->station_name = name; }
+    // Options for files queued by name on behalf of clients.
+    void set_file_options(AudioFileOptions options) { this->file_options = options; }
+    AudioFileOptions get_file_options() { return this->file_options; }
+    // Blocks go out this many milliseconds before they start playing, so
+    // clients can buffer across network hiccups. Clients schedule playback
+    // from each block's sequence number and stream timestamp.
+    void set_send_ahead(double ms);
+    // Seconds of recent audio replayed to each new subscriber.
+    void set_join_burst(double seconds) { this->join_burst = seconds; }
+    // Overlap between consecutive tracks; 0 plays them back to back.
+    void set_crossfade(double seconds);
+    // Scales each track towards target integrated loudness (LUFS) once its
+    // background analysis is done; tracks play unscaled until then.
+    void set_normalization(bool enabled, double target = LOUDNESS_DEFAULT_TARGET);
 
 private:
+    std::string station_name;
     bool is_playing = false;
-    std::chrono::time_point<std::chrono::high_resolution_clock> audio_block_start_time;
+    bool head_ready = true;
+    uint64_t broadcast_sequence = 0;
+    double stream_time = 0;
+    PlaybackClock clock;
+    BroadcastHistory history;
+    // Read by catch_up() on connection threads.
+    std::atomic<double> join_burst{BROADCAST_HISTORY_DEFAULT_BURST};
     std::vector<std::shared_ptr<AudioFile>> audio_files;
-    std::vector<std::weak_ptr<IAudioListener>> listeners;
+    ListenerRegistry listeners;
+    // Changes made since the last published version; they go out as one
+    // delta at the end of the tick that made them.
+    uint64_t queue_version = 0;
+    nlohmann::json pending_ops = nlohmann::json::array();
+    bool queue_changed = false;
+    std::shared_ptr<QueueUpdate> snapshot;
+    AudioDecoder decoder;
+    std::unique_ptr<OpusEncoderStage> output_encoder;
+    AudioFileOptions file_options;
+    AudioMixer mixer;
+    bool normalize = true;
+    double normalize_target = LOUDNESS_DEFAULT_TARGET;
+    MpscQueue<AudioQueueCommand> commands;
+    AudioQueueCommandStats command_stats;
+    double total_command_latency_us = 0;
+
+    void apply_commands(std::chrono::steady_clock::time_point now);
+    std::chrono::steady_clock::time_point play(std::chrono::steady_clock::time_point now);
+    // Everything in queue_info() but the file list.
+    nlohmann::json state_info();
+    void record(nlohmann::json op);
+    void mark_changed() { this->queue_changed = true; }
+    void publish_changes();
+    std::shared_ptr<AudioBlock> next_block();
+    float track_gain(const std::shared_ptr<AudioFile> &file);
+    void reset_mixer();
 };
 
-class AudioQueueRwLock
+// A station's queue. Only its scheduler runs it; everybody else posts
+// commands and reads published snapshots, so it has no lock.
+class Station
 {
 public:
-    AudioQueueRwLock() : readers(0), writer(false){};
-
-    void lock_write();
-    void unlock_write();
-    void lock_read();
-    void unlock_read();
-
     AudioQueue &get_queue();
 
 private:
     AudioQueue queue;
-    std::mutex mutex;
-    std::condition_variable read_condition;
-    std::condition_variable write_condition;
-    int readers;
-    bool writer;
 };
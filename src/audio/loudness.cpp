@@ -0,0 +1,117 @@
+#include "loudness.h"
+#include "mix_kernels.h"
+#include <algorithm>
+#include <cmath>
+
+LoudnessMeter::LoudnessMeter(int channels, long rate)
+{
+    this->channels = channels;
+    this->subblock_frames = std::max<long>(rate / 10, 1);
+    this->subblock_filled = 0;
+    this->subblock_energy = 0;
+    this->peak = 0;
+
+    // BS.1770 pre-filter (high shelf) and RLB high-pass, derived for the
+    // actual sampling rate rather than the 48 kHz reference coefficients.
+    Biquad shelf;
+    double f0 = 1681.974450955533;
+    double gain = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = std::tan(M_PI * f0 / rate);
+    double vh = std::pow(10.0, gain / 20.0);
+    double vb = std::pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    shelf.b1 = 2.0 * (k * k - vh) / a0;
+    shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+    shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+    Biquad highpass;
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = std::tan(M_PI * f0 / rate);
+    a0 = 1.0 + k / q + k * k;
+    highpass.b0 = 1.0;
+    highpass.b1 = -2.0;
+    highpass.b2 = 1.0;
+    highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+    highpass.a2 = (1.0 - k / q + k * k) / a0;
+
+    this->shelf.assign(channels, shelf);
+    this->highpass.assign(channels, highpass);
+}
+
+void LoudnessMeter::add(const float *samples, size_t frames)
+{
+    if (this->channels <= 0)
+        return;
+
+    this->peak = std::max<double>(this->peak, mix_peak(samples, frames * this->channels));
+
+    size_t offset = 0;
+    while (offset < frames)
+    {
+        size_t count = std::min(frames - offset, this->subblock_frames - this->subblock_filled);
+        this->scratch.resize(count);
+
+        for (int c = 0; c < this->channels; c++)
+        {
+            Biquad &shelf = this->shelf[c];
+            Biquad &highpass = this->highpass[c];
+            for (size_t i = 0; i < count; i++)
+                this->scratch[i] = highpass.process(shelf.process(samples[(offset + i) * this->channels + c]));
+            this->subblock_energy += mix_sum_squares(this->scratch.data(), count);
+        }
+
+        offset += count;
+        this->subblock_filled += count;
+        if (this->subblock_filled == this->subblock_frames)
+        {
+            this->subblocks.push_back(this->subblock_energy / this->subblock_frames);
+            this->subblock_energy = 0;
+            this->subblock_filled = 0;
+        }
+    }
+}
+
+static double loudness_of(double energy)
+{
+    return -0.691 + 10.0 * std::log10(energy);
+}
+
+LoudnessResult LoudnessMeter::result()
+{
+    LoudnessResult result;
+    result.peak = this->peak;
+
+    // 400 ms gating blocks are four consecutive 100 ms sub-blocks.
+    std::vector<double> blocks;
+    for (size_t i = 3; i < this->subblocks.size(); i++)
+    {
+        double energy = (this->subblocks[i - 3] + this->subblocks[i - 2] + this->subblocks[i - 1] + this->subblocks[i]) / 4.0;
+        if (energy > 0 && loudness_of(energy) > LOUDNESS_SILENCE)
+            blocks.push_back(energy);
+    }
+    if (blocks.empty())
+        return result;
+
+    double sum = 0;
+    for (double energy : blocks)
+        sum += energy;
+    double relative_gate = loudness_of(sum / blocks.size()) - 10.0;
+
+    sum = 0;
+    size_t count = 0;
+    for (double energy : blocks)
+    {
+        if (loudness_of(energy) > relative_gate)
+        {
+            sum += energy;
+            count++;
+        }
+    }
+    if (count > 0)
+        result.integrated = loudness_of(sum / count);
+    return result;
+}
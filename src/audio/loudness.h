@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#define LOUDNESS_DEFAULT_TARGET -16.0
+// Integrated loudness of digital silence, below the absolute gate.
+#define LOUDNESS_SILENCE -70.0
+
+struct LoudnessResult
+{
+    // Integrated loudness in LUFS and sample peak (1.0 is full scale).
+    double integrated = LOUDNESS_SILENCE;
+    double peak = 0;
+};
+
+// EBU R128 / ITU-R BS.1770 integrated loudness meter: K-weighting, 400 ms
+// gating blocks with 75% overlap, absolute (-70 LUFS) and relative (-10 LU)
+// gates. All channels are weighted 1.0, which is what BS.1770 specifies for
+// mono and stereo. The K-weighting filters are recursive and run per
+// sample; the energy and peak reductions use the vectorized kernels.
+class LoudnessMeter
+{
+public:
+    LoudnessMeter(int channels, long rate);
+
+    // Adds interleaved float samples.
+    void add(const float *samples, size_t frames);
+    LoudnessResult result();
+
+private:
+    struct Biquad
+    {
+        double b0, b1, b2, a1, a2;
+        double z1 = 0, z2 = 0;
+
+        double process(double x)
+        {
+            double y = b0 * x + z1;
+            z1 = b1 * x - a1 * y + z2;
+            z2 = b2 * x - a2 * y;
+            return y;
+        }
+    };
+
+    int channels;
+    size_t subblock_frames;
+    size_t subblock_filled;
+    double subblock_energy;
+    double peak;
+
+    std::vector<Biquad> shelf;
+    std::vector<Biquad> highpass;
+    std::vector<float> scratch;
+    // Mean square of every completed 100 ms sub-block, summed over channels.
+    std::vector<double> subblocks;
+};
@@ -0,0 +1,343 @@
+#include "mix_kernels.h"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIX_KERNELS_X86
+#endif
+
+static void s16_to_f32_scalar(const int16_t *in, float *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = in[i] * (1.0f / 32768.0f);
+}
+
+static void f32_to_s16_scalar(const float *in, int16_t *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float sample = std::min(1.0f, std::max(-1.0f, in[i]));
+        out[i] = (int16_t)lrintf(sample * 32767.0f);
+    }
+}
+
+static void crossfade_scalar(const float *a, const float *b, float *out, size_t n, float gain, float step)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float g = gain - i * step;
+        out[i] = a[i] * g + b[i] * (1.0f - g);
+    }
+}
+
+static void gain_scalar(float *data, size_t n, float gain)
+{
+    for (size_t i = 0; i < n; i++)
+        data[i] *= gain;
+}
+
+static double sum_squares_scalar(const float *data, size_t n)
+{
+    double sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += (double)data[i] * data[i];
+    return sum;
+}
+
+static float peak_scalar(const float *data, size_t n)
+{
+    float peak = 0;
+    for (size_t i = 0; i < n; i++)
+        peak = std::max(peak, std::fabs(data[i]));
+    return peak;
+}
+
+#ifdef MIX_KERNELS_X86
+
+__attribute__((target("sse2"))) static void s16_to_f32_sse2(const int16_t *in, float *out, size_t n)
+{
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i samples = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+    }
+    s16_to_f32_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void f32_to_s16_sse2(const float *in, int16_t *out, size_t n)
+{
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 minus_one = _mm_set1_ps(-1.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128 low = _mm_min_ps(one, _mm_max_ps(minus_one, _mm_loadu_ps(in + i)));
+        __m128 high = _mm_min_ps(one, _mm_max_ps(minus_one, _mm_loadu_ps(in + i + 4)));
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(low, scale)), _mm_cvtps_epi32(_mm_mul_ps(high, scale)));
+        _mm_storeu_si128((__m128i *)(out + i), packed);
+    }
+    f32_to_s16_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("sse2"))) static void crossfade_sse2(const float *a, const float *b, float *out, size_t n, float gain, float step)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 advance = _mm_set1_ps(4 * step);
+    __m128 g = _mm_sub_ps(_mm_set1_ps(gain), _mm_mul_ps(_mm_set1_ps(step), _mm_set_ps(3, 2, 1, 0)));
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 va = _mm_loadu_ps(a + i);
+        __m128 vb = _mm_loadu_ps(b + i);
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(va, g), _mm_mul_ps(vb, _mm_sub_ps(one, g))));
+        g = _mm_sub_ps(g, advance);
+    }
+    crossfade_scalar(a + i, b + i, out + i, n - i, gain - i * step, step);
+}
+
+__attribute__((target("sse2"))) static void gain_sse2(float *data, size_t n, float gain)
+{
+    const __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(data + i, _mm_mul_ps(_mm_loadu_ps(data + i), g));
+    gain_scalar(data + i, n - i, gain);
+}
+
+__attribute__((target("sse2"))) static double sum_squares_sse2(const float *data, size_t n)
+{
+    __m128d sum = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(data + i);
+        __m128 squares = _mm_mul_ps(v, v);
+        sum = _mm_add_pd(sum, _mm_cvtps_pd(squares));
+        sum = _mm_add_pd(sum, _mm_cvtps_pd(_mm_movehl_ps(squares, squares)));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, sum);
+    return lanes[0] + lanes[1] + sum_squares_scalar(data + i, n - i);
+}
+
+__attribute__((target("sse2"))) static float peak_sse2(const float *data, size_t n)
+{
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 peak = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        peak = _mm_max_ps(peak, _mm_and_ps(_mm_loadu_ps(data + i), abs_mask));
+    float lanes[4];
+    _mm_storeu_ps(lanes, peak);
+    float result = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    return std::max(result, peak_scalar(data + i, n - i));
+}
+
+__attribute__((target("avx2"))) static void s16_to_f32_avx2(const int16_t *in, float *out, size_t n)
+{
+    const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i samples = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(samples), scale));
+    }
+    s16_to_f32_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void f32_to_s16_avx2(const float *in, int16_t *out, size_t n)
+{
+    const __m256 scale = _mm256_set1_ps(32767.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 minus_one = _mm256_set1_ps(-1.0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256 low = _mm256_min_ps(one, _mm256_max_ps(minus_one, _mm256_loadu_ps(in + i)));
+        __m256 high = _mm256_min_ps(one, _mm256_max_ps(minus_one, _mm256_loadu_ps(in + i + 8)));
+        __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(_mm256_mul_ps(low, scale)), _mm256_cvtps_epi32(_mm256_mul_ps(high, scale)));
+        // packs works per 128-bit lane; restore the sample order.
+        packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+    f32_to_s16_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void crossfade_avx2(const float *a, const float *b, float *out, size_t n, float gain, float step)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 advance = _mm256_set1_ps(8 * step);
+    __m256 g = _mm256_sub_ps(_mm256_set1_ps(gain), _mm256_mul_ps(_mm256_set1_ps(step), _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0)));
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 va = _mm256_loadu_ps(a + i);
+        __m256 vb = _mm256_loadu_ps(b + i);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(va, g), _mm256_mul_ps(vb, _mm256_sub_ps(one, g))));
+        g = _mm256_sub_ps(g, advance);
+    }
+    crossfade_scalar(a + i, b + i, out + i, n - i, gain - i * step, step);
+}
+
+__attribute__((target("avx2"))) static void gain_avx2(float *data, size_t n, float gain)
+{
+    const __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(data + i, _mm256_mul_ps(_mm256_loadu_ps(data + i), g));
+    gain_scalar(data + i, n - i, gain);
+}
+
+__attribute__((target("avx2"))) static double sum_squares_avx2(const float *data, size_t n)
+{
+    __m256d sum = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 v = _mm256_loadu_ps(data + i);
+        __m256 squares = _mm256_mul_ps(v, v);
+        sum = _mm256_add_pd(sum, _mm256_cvtps_pd(_mm256_castps256_ps128(squares)));
+        sum = _mm256_add_pd(sum, _mm256_cvtps_pd(_mm256_extractf128_ps(squares, 1)));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum_squares_scalar(data + i, n - i);
+}
+
+__attribute__((target("avx2"))) static float peak_avx2(const float *data, size_t n)
+{
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    __m256 peak = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        peak = _mm256_max_ps(peak, _mm256_and_ps(_mm256_loadu_ps(data + i), abs_mask));
+    float lanes[8];
+    _mm256_storeu_ps(lanes, peak);
+    float result = 0;
+    for (float lane : lanes)
+        result = std::max(result, lane);
+    return std::max(result, peak_scalar(data + i, n - i));
+}
+
+#endif
+
+struct MixKernels
+{
+    const char *name;
+    void (*s16_to_f32)(const int16_t *, float *, size_t);
+    void (*f32_to_s16)(const float *, int16_t *, size_t);
+    void (*crossfade)(const float *, const float *, float *, size_t, float, float);
+    void (*gain)(float *, size_t, float);
+    double (*sum_squares)(const float *, size_t);
+    float (*peak)(const float *, size_t);
+};
+
+static MixKernels select_kernels()
+{
+#ifdef MIX_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return MixKernels{"avx2", s16_to_f32_avx2, f32_to_s16_avx2, crossfade_avx2, gain_avx2, sum_squares_avx2, peak_avx2};
+    if (__builtin_cpu_supports("sse2"))
+        return MixKernels{"sse2", s16_to_f32_sse2, f32_to_s16_sse2, crossfade_sse2, gain_sse2, sum_squares_sse2, peak_sse2};
+#endif
+    return MixKernels{"scalar", s16_to_f32_scalar, f32_to_s16_scalar, crossfade_scalar, gain_scalar, sum_squares_scalar, peak_scalar};
+}
+
+static const MixKernels &kernels()
+{
+    static const MixKernels selected = select_kernels();
+    return selected;
+}
+
+void mix_s16_to_f32(const int16_t *in, float *out, size_t n)
+{
+    kernels().s16_to_f32(in, out, n);
+}
+
+void mix_f32_to_s16(const float *in, int16_t *out, size_t n)
+{
+    kernels().f32_to_s16(in, out, n);
+}
+
+void mix_crossfade(const float *a, const float *b, float *out, size_t n, float gain, float step)
+{
+    kernels().crossfade(a, b, out, n, gain, step);
+}
+
+void mix_gain(float *data, size_t n, float gain)
+{
+    kernels().gain(data, n, gain);
+}
+
+double mix_sum_squares(const float *data, size_t n)
+{
+    return kernels().sum_squares(data, n);
+}
+
+float mix_peak(const float *data, size_t n)
+{
+    return kernels().peak(data, n);
+}
+
+const char *mix_kernels_name()
+{
+    return kernels().name;
+}
+
+void LinearResampler::configure(int channels, int input_rate, int output_rate)
+{
+    if (channels == this->channels && input_rate == this->input_rate && output_rate == this->output_rate)
+        return;
+
+    this->channels = channels;
+    this->input_rate = input_rate;
+    this->output_rate = output_rate;
+    this->reset();
+}
+
+void LinearResampler::reset()
+{
+    this->source_position = 0;
+    this->previous.assign(this->channels, 0.0f);
+}
+
+void LinearResampler::process(const float *input, size_t frames, std::vector<float> &output)
+{
+    if (frames == 0)
+        return;
+
+    if (this->input_rate == this->output_rate)
+    {
+        output.insert(output.end(), input, input + frames * this->channels);
+        return;
+    }
+
+    // Each output frame reads input at index + 1, so a position on the last
+    // frame waits for the next block, where it becomes -1 and reads previous.
+    double step = (double)this->input_rate / this->output_rate;
+    while (this->source_position < (double)frames - 1)
+    {
+        long index = (long)std::floor(this->source_position);
+        float fraction = this->source_position - index;
+        for (int c = 0; c < this->channels; c++)
+        {
+            float a = index < 0 ? this->previous[c] : input[index * this->channels + c];
+            float b = input[(index + 1) * this->channels + c];
+            output.push_back(a + (b - a) * fraction);
+        }
+        this->source_position += step;
+    }
+
+    this->source_position -= frames;
+    for (int c = 0; c < this->channels; c++)
+        this->previous[c] = input[(frames - 1) * this->channels + c];
+}
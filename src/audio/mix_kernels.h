@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Sample kernels used by the mixer and output stages. Each one has a scalar
+// version and, on x86, SSE2 and AVX2 versions picked once at startup from
+// what the CPU supports. All buffers are interleaved samples; n counts
+// samples, not frames.
+
+void mix_s16_to_f32(const int16_t *in, float *out, size_t n);
+// Clamps to [-1, 1] before converting.
+void mix_f32_to_s16(const float *in, int16_t *out, size_t n);
+// out[i] = a[i] * g + b[i] * (1 - g), with g = gain - i * step.
+void mix_crossfade(const float *a, const float *b, float *out, size_t n, float gain, float step);
+// data[i] *= gain
+void mix_gain(float *data, size_t n, float gain);
+// Sum of data[i]^2.
+double mix_sum_squares(const float *data, size_t n);
+// Largest |data[i]|.
+float mix_peak(const float *data, size_t n);
+
+// Name of the kernel set in use, for logging.
+const char *mix_kernels_name();
+
+// Linear-interpolating sample rate converter that carries its state across
+// blocks, so consecutive blocks resample without seams.
+class LinearResampler
+{
+public:
+    LinearResampler() : channels(0), input_rate(0), output_rate(0), source_position(0) {}
+
+    // Resets the state when the format changes.
+    void configure(int channels, int input_rate, int output_rate);
+    void reset();
+    // Appends the resampled frames of input (frames * channels samples) to output.
+    void process(const float *input, size_t frames, std::vector<float> &output);
+
+private:
+    int channels;
+    int input_rate;
+    int output_rate;
+    // Read position relative to the current input block; -1 is the last
+    // frame of the previous block, kept in previous.
+    double source_position;
+    std::vector<float> previous;
+};
@@ -0,0 +1,94 @@
+#include "opus_encoder_stage.h"
+#include <cstring>
+
+OpusEncoderStage::OpusEncoderStage(int bitrate)
+{
+    this->encoder = NULL;
+    this->channels = 0;
+    this->bitrate = bitrate;
+}
+
+OpusEncoderStage::~OpusEncoderStage()
+{
+    if (this->encoder != NULL)
+        opus_encoder_destroy(this->encoder);
+}
+
+void OpusEncoderStage::set_bitrate(int bitrate)
+{
+    this->bitrate = bitrate;
+    if (this->encoder != NULL)
+        opus_encoder_ctl(this->encoder, OPUS_SET_BITRATE(bitrate));
+}
+
+bool OpusEncoderStage::configure(int channels, int rate)
+{
+    if (this->encoder == NULL || channels != this->channels)
+    {
+        if (this->encoder != NULL)
+            opus_encoder_destroy(this->encoder);
+
+        int error;
+        this->encoder = opus_encoder_create(OPUS_STAGE_RATE, channels, OPUS_APPLICATION_AUDIO, &error);
+        if (error != OPUS_OK)
+        {
+            std::cerr << "Could not create Opus encoder: " << opus_strerror(error) << '\n';
+            this->encoder = NULL;
+            return false;
+        }
+        opus_encoder_ctl(this->encoder, OPUS_SET_BITRATE(this->bitrate));
+        this->pending.clear();
+    }
+
+    this->channels = channels;
+    this->resampler.configure(channels, rate, OPUS_STAGE_RATE);
+    return true;
+}
+
+std::shared_ptr<AudioBlock> OpusEncoderStage::encode(std::shared_ptr<AudioBlock> block)
+{
+    int channels = block->channels;
+    int encoding = block->encoding;
+    if (block->codec != AudioCodec::PCM)
+        return block;
+    if (encoding != MPG123_ENC_SIGNED_16 && encoding != MPG123_ENC_FLOAT_32)
+        return block;
+    if (!this->configure(channels, block->sampling_rate))
+        return block;
+
+    size_t frames = block->size / (channels * mpg123_encsize(encoding));
+    std::vector<float> input(frames * channels);
+    if (encoding == MPG123_ENC_SIGNED_16)
+        mix_s16_to_f32((const int16_t *)block->data, input.data(), input.size());
+    else
+        memcpy(input.data(), block->data, input.size() * sizeof(float));
+
+    this->resampler.process(input.data(), frames, this->pending);
+
+    std::vector<unsigned char> packets;
+    unsigned char packet[OPUS_STAGE_MAX_PACKET];
+    size_t frame_size = OPUS_STAGE_FRAME_SAMPLES * this->channels;
+    size_t consumed = 0;
+    while (this->pending.size() - consumed >= frame_size)
+    {
+        opus_int32 length = opus_encode_float(this->encoder, this->pending.data() + consumed, OPUS_STAGE_FRAME_SAMPLES, packet, sizeof(packet));
+        consumed += frame_size;
+        if (length < 0)
+        {
+            std::cerr << "Opus encoding failed: " << opus_strerror(length) << '\n';
+            continue;
+        }
+
+        packets.push_back((length >> 8) & 0xFF);
+        packets.push_back(length & 0xFF);
+        packets.insert(packets.end(), packet, packet + length);
+    }
+    this->pending.erase(this->pending.begin(), this->pending.begin() + consumed);
+
+    unsigned char *data = new unsigned char[packets.size()];
+    memcpy(data, packets.data(), packets.size());
+    auto encoded = std::make_shared<AudioBlock>(data, packets.size(), block->duration, OPUS_STAGE_RATE);
+    encoded->codec = AudioCodec::OPUS;
+    encoded->channels = channels;
+    return encoded;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "audio_file.h"
+#include "mix_kernels.h"
+#include <opus/opus.h>
+#include <memory>
+#include <vector>
+
+#define OPUS_STAGE_RATE 48000
+#define OPUS_STAGE_FRAME_SAMPLES 960 // 20 ms at 48 kHz
+#define OPUS_STAGE_MAX_PACKET 4000
+#define OPUS_STAGE_DEFAULT_BITRATE 96000
+
+// Output codec stage that sits between AudioQueue::update and the listener
+// fan-out. Every PCM block is encoded exactly once and the resulting block
+// is shared by all listeners.
+//
+// Opus only runs at 48 kHz in fixed 20 ms frames, so input is resampled and
+// buffered across blocks. The returned block keeps the input block's
+// duration for pacing and carries zero or more packets, each prefixed by
+// its length as a big-endian uint16.
+class OpusEncoderStage
+{
+public:
+    OpusEncoderStage(int bitrate = OPUS_STAGE_DEFAULT_BITRATE);
+    ~OpusEncoderStage();
+
+    OpusEncoderStage(const OpusEncoderStage &) = delete;
+    OpusEncoderStage &operator=(const OpusEncoderStage &) = delete;
+
+    std::shared_ptr<AudioBlock> encode(std::shared_ptr<AudioBlock> block);
+    void set_bitrate(int bitrate);
+    int get_bitrate() { return this->bitrate; }
+
+private:
+    OpusEncoder *encoder;
+    int channels;
+    int bitrate;
+    LinearResampler resampler;
+
+    // Interleaved 48 kHz samples not yet making up a full Opus frame.
+    std::vector<float> pending;
+
+    bool configure(int channels, int rate);
+};
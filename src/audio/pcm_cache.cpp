@@ -0,0 +1,239 @@
+#include "pcm_cache.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define PCM_CACHE_MAGIC "SK2PCM\r\n"
+#define PCM_CACHE_VERSION 2
+// The path is padded so the PCM starts on this boundary; blocks alias the
+// mapping and are read as int16_t or float samples in place.
+#define PCM_CACHE_DATA_ALIGNMENT 16
+
+struct PcmCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t path_length;
+    uint64_t source_size;
+    int64_t source_mtime;
+    int64_t rate;
+    int32_t channels;
+    int32_t encoding;
+    uint64_t block_count;
+    uint64_t index_offset;
+};
+
+static uint64_t data_start(uint64_t path_length)
+{
+    uint64_t end = sizeof(PcmCacheHeader) + path_length;
+    return (end + PCM_CACHE_DATA_ALIGNMENT - 1) / PCM_CACHE_DATA_ALIGNMENT * PCM_CACHE_DATA_ALIGNMENT;
+}
+
+class PcmCacheMapping
+{
+public:
+    PcmCacheMapping(void *address, size_t length) : address(address), length(length) {}
+    ~PcmCacheMapping()
+    {
+        munmap(this->address, this->length);
+    }
+
+    PcmCacheMapping(const PcmCacheMapping &) = delete;
+    PcmCacheMapping &operator=(const PcmCacheMapping &) = delete;
+
+    void *address;
+    size_t length;
+};
+
+PcmCache::PcmCache(std::string directory) : directory(directory)
+{
+    if (mkdir(this->directory.c_str(), 0755) < 0 && errno != EEXIST)
+        std::cerr << "Could not create PCM cache directory " << this->directory << ": " << strerror(errno) << '\n';
+}
+
+bool PcmCache::entry_path(const std::string &path, std::string &cache_path, uint64_t &size, int64_t &mtime)
+{
+    struct stat source;
+    if (stat(path.c_str(), &source) < 0)
+        return false;
+
+    size = source.st_size;
+    mtime = (int64_t)source.st_mtim.tv_sec * 1000000000 + source.st_mtim.tv_nsec;
+
+    std::ostringstream key;
+    key << path << '|' << size << '|' << mtime;
+
+    std::ostringstream name;
+    name << this->directory << '/' << std::hex << std::hash<std::string>()(key.str()) << ".pcm";
+    cache_path = name.str();
+    return true;
+}
+
+std::unique_ptr<PcmCacheHit> PcmCache::lookup(const std::string &path)
+{
+    std::string cache_path;
+    uint64_t source_size;
+    int64_t source_mtime;
+    if (!this->entry_path(path, cache_path, source_size, source_mtime))
+        return nullptr;
+
+    int fd = open(cache_path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat cached;
+    if (fstat(fd, &cached) < 0 || (size_t)cached.st_size < sizeof(PcmCacheHeader))
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    size_t length = cached.st_size;
+    void *address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+        return nullptr;
+
+    madvise(address, length, MADV_SEQUENTIAL);
+    auto mapping = std::make_shared<PcmCacheMapping>(address, length);
+    const unsigned char *base = (const unsigned char *)address;
+
+    PcmCacheHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, PCM_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != PCM_CACHE_VERSION)
+        return nullptr;
+    if (header.source_size != source_size || header.source_mtime != source_mtime)
+        return nullptr;
+    if (header.path_length != path.size() || data_start(header.path_length) > length)
+        return nullptr;
+    if (memcmp(base + sizeof(header), path.data(), path.size()) != 0)
+        return nullptr;
+    if (header.index_offset > length || (length - header.index_offset) / sizeof(PcmCacheWriter::IndexEntry) < header.block_count)
+        return nullptr;
+    if (header.channels <= 0 || mpg123_encsize(header.encoding) <= 0)
+        return nullptr;
+    size_t sample_size = mpg123_encsize(header.encoding);
+
+    std::unique_ptr<PcmCacheHit> hit = std::make_unique<PcmCacheHit>();
+    hit->rate = header.rate;
+    hit->channels = header.channels;
+    hit->encoding = header.encoding;
+    hit->blocks.reserve(header.block_count);
+    auto arena = std::make_shared<AudioArena>(0, mapping);
+
+    for (uint64_t i = 0; i < header.block_count; i++)
+    {
+        PcmCacheWriter::IndexEntry entry;
+        memcpy(&entry, base + header.index_offset + i * sizeof(entry), sizeof(entry));
+        if (entry.offset > header.index_offset || entry.size > header.index_offset - entry.offset)
+            return nullptr;
+        // The mapping is page aligned, so this keeps every sample aligned.
+        if (entry.offset < data_start(header.path_length) || entry.offset % sample_size != 0)
+            return nullptr;
+
+        unsigned char *data = (unsigned char *)base + entry.offset;
+        auto block = AudioArena::add_block(arena, data, entry.size, entry.duration, entry.rate);
+        block->channels = header.channels;
+        block->encoding = header.encoding;
+        hit->blocks.push_back(block);
+    }
+
+    return hit;
+}
+
+std::unique_ptr<PcmCacheWriter> PcmCache::create(const std::string &path, long rate, int channels, int encoding)
+{
+    static std::atomic<unsigned long> sequence(0);
+
+    std::unique_ptr<PcmCacheWriter> writer(new PcmCacheWriter());
+    uint64_t source_size;
+    int64_t source_mtime;
+    if (!this->entry_path(path, writer->final_path, source_size, source_mtime))
+        return nullptr;
+
+    std::ostringstream temp_path;
+    temp_path << writer->final_path << ".tmp." << getpid() << '.' << sequence++;
+    writer->temp_path = temp_path.str();
+
+    writer->file = fopen(writer->temp_path.c_str(), "wb");
+    if (writer->file == NULL)
+        return nullptr;
+
+    PcmCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PCM_CACHE_MAGIC, sizeof(header.magic));
+    header.version = PCM_CACHE_VERSION;
+    header.path_length = path.size();
+    header.source_size = source_size;
+    header.source_mtime = source_mtime;
+    header.rate = rate;
+    header.channels = channels;
+    header.encoding = encoding;
+
+    writer->header.resize(sizeof(header));
+    memcpy(writer->header.data(), &header, sizeof(header));
+
+    static const char padding[PCM_CACHE_DATA_ALIGNMENT] = {};
+    size_t padding_size = data_start(path.size()) - sizeof(header) - path.size();
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1 || fwrite(path.data(), 1, path.size(), writer->file) != path.size() ||
+        fwrite(padding, 1, padding_size, writer->file) != padding_size)
+        writer->failed = true;
+    writer->data_end = data_start(path.size());
+
+    return writer;
+}
+
+PcmCacheWriter::~PcmCacheWriter()
+{
+    if (this->file == NULL)
+        return;
+    fclose(this->file);
+    unlink(this->temp_path.c_str());
+}
+
+bool PcmCacheWriter::append(const unsigned char *data, size_t size, double duration, long rate)
+{
+    if (this->failed || this->file == NULL)
+        return false;
+
+    if (fwrite(data, 1, size, this->file) != size)
+    {
+        this->failed = true;
+        return false;
+    }
+
+    this->index.push_back(IndexEntry{this->data_end, size, duration, rate});
+    this->data_end += size;
+    return true;
+}
+
+bool PcmCacheWriter::commit()
+{
+    if (this->failed || this->file == NULL)
+        return false;
+
+    PcmCacheHeader header;
+    memcpy(&header, this->header.data(), sizeof(header));
+    header.block_count = this->index.size();
+    header.index_offset = this->data_end;
+
+    bool ok = fwrite(this->index.data(), sizeof(IndexEntry), this->index.size(), this->file) == this->index.size();
+    ok = ok && fseek(this->file, 0, SEEK_SET) == 0;
+    ok = ok && fwrite(&header, sizeof(header), 1, this->file) == 1;
+    ok = fclose(this->file) == 0 && ok;
+    this->file = NULL;
+
+    if (ok && rename(this->temp_path.c_str(), this->final_path.c_str()) == 0)
+        return true;
+
+    unlink(this->temp_path.c_str());
+    return false;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "audio_file.h"
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+
+// On-disk cache of decoded PCM. Each entry holds a header, the source path
+// it was decoded from, padded so the PCM starts on a 16 byte boundary, the
+// raw PCM of every block back to back and an index of (offset, size,
+// duration, rate) per block. Entries are keyed by source path, size and
+// mtime, so editing a file simply misses the old entry.
+//
+// Hits are mmap'ed read-only; the returned AudioBlocks point straight into
+// the mapping and keep it alive, so a hit costs no decode and no heap copy.
+
+struct PcmCacheHit
+{
+    long rate;
+    int channels;
+    int encoding;
+    std::vector<std::shared_ptr<AudioBlock>> blocks;
+};
+
+class PcmCacheWriter
+{
+public:
+    ~PcmCacheWriter();
+
+    bool append(const unsigned char *data, size_t size, double duration, long rate);
+    bool commit();
+
+private:
+    friend class PcmCache;
+    PcmCacheWriter() : file(NULL), failed(false){};
+
+    struct IndexEntry
+    {
+        uint64_t offset;
+        uint64_t size;
+        double duration;
+        int64_t rate;
+    };
+
+    FILE *file;
+    bool failed;
+    std::string temp_path;
+    std::string final_path;
+    std::vector<unsigned char> header;
+    std::vector<IndexEntry> index;
+    uint64_t data_end;
+};
+
+class PcmCache
+{
+public:
+    PcmCache(std::string directory);
+
+    std::unique_ptr<PcmCacheHit> lookup(const std::string &path);
+    std::unique_ptr<PcmCacheWriter> create(const std::string &path, long rate, int channels, int encoding);
+
+private:
+    std::string directory;
+
+    bool entry_path(const std::string &path, std::string &cache_path, uint64_t &size, int64_t &mtime);
+};
@@ -0,0 +1,45 @@
+#include "playback_clock.h"
+
+PlaybackClock::PlaybackClock()
+{
+    this->elapsed = 0;
+    this->total_jitter_us = 0;
+    this->lead = std::chrono::steady_clock::duration::zero();
+    this->restart(std::chrono::steady_clock::now());
+}
+
+void PlaybackClock::restart(time_point now)
+{
+    this->origin = now;
+    this->elapsed = 0;
+    this->next_deadline = now;
+}
+
+void PlaybackClock::tick(time_point now)
+{
+    auto late = now - this->deadline();
+    if (late > std::chrono::milliseconds(PLAYBACK_CLOCK_MAX_LATENESS_MS))
+    {
+        this->counters.resyncs++;
+        this->restart(now);
+        return;
+    }
+
+    double jitter = std::chrono::duration<double, std::micro>(late).count();
+    this->counters.ticks++;
+    this->counters.last_jitter_us = jitter;
+    this->counters.max_jitter_us = std::max(this->counters.max_jitter_us, jitter);
+    this->total_jitter_us += jitter;
+    this->counters.mean_jitter_us = this->total_jitter_us / this->counters.ticks;
+}
+
+void PlaybackClock::set_lead(double seconds)
+{
+    this->lead = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(std::max(0.0, seconds)));
+}
+
+void PlaybackClock::advance(double seconds)
+{
+    this->elapsed += seconds;
+    this->next_deadline = this->origin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(this->elapsed));
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+// How far behind its deadline the clock may fall (a stall, a suspended
+// process) before it gives up catching up and restarts from now.
+#define PLAYBACK_CLOCK_MAX_LATENESS_MS 1000
+
+struct PlaybackClockStats
+{
+    unsigned long long ticks = 0;
+    unsigned long long resyncs = 0;
+    // How late, in microseconds, ticks ran after their deadline.
+    double last_jitter_us = 0;
+    double mean_jitter_us = 0;
+    double max_jitter_us = 0;
+};
+
+// Absolute-deadline clock for the playback loop. Deadlines are derived from
+// a fixed origin plus the summed durations of everything emitted since, so
+// the time a tick runs late never carries over into the next one. With a
+// lead set, each block is due that long before it starts playing.
+class PlaybackClock
+{
+public:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    PlaybackClock();
+
+    // Starts counting from now, e.g. after a pause or while waiting for a
+    // track; nothing before it is caught up.
+    void restart(time_point now);
+    // The first lead seconds after a restart are due at once.
+    time_point deadline() { return std::max(this->origin, this->next_deadline - this->lead); }
+    bool due(time_point now) { return now >= this->deadline(); }
+    void set_lead(double seconds);
+    double get_lead() { return std::chrono::duration<double>(this->lead).count(); }
+    // Records a tick that ran at now for the current deadline.
+    void tick(time_point now);
+    // Moves the deadline on by seconds of emitted audio.
+    void advance(double seconds);
+
+    PlaybackClockStats stats() { return this->counters; }
+
+private:
+    time_point origin;
+    double elapsed;
+    time_point next_deadline;
+    std::chrono::steady_clock::duration lead;
+    double total_jitter_us;
+    PlaybackClockStats counters;
+};
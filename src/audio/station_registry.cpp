@@ -0,0 +1,87 @@
+#include "station_registry.h"
+#include <algorithm>
+
+StationRegistry::StationRegistry(size_t workers)
+{
+    this->stopping = false;
+    for (size_t i = 0; i < std::max<size_t>(workers, 1); i++)
+        this->workers.emplace_back(&StationRegistry::work, this);
+}
+
+StationRegistry::~StationRegistry()
+{
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->condition.notify_all();
+
+    for (auto &worker : this->workers)
+        worker.join();
+}
+
+std::shared_ptr<Station> StationRegistry::create(const std::string &name)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    auto it = this->stations.find(name);
+    if (it != this->stations.end())
+        return it->second;
+
+    auto station = std::make_shared<Station>();
+    station->get_queue().set_station_name(name);
+    this->stations[name] = station;
+    this->timers.push(Entry{std::chrono::steady_clock::now(), station});
+    lock.unlock();
+
+    this->condition.notify_one();
+    return station;
+}
+
+std::shared_ptr<Station> StationRegistry::find(const std::string &name)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    auto it = this->stations.find(name);
+    return it != this->stations.end() ? it->second : nullptr;
+}
+
+std::vector<std::string> StationRegistry::names()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    std::vector<std::string> names;
+    for (auto &station : this->stations)
+        names.push_back(station.first);
+    return names;
+}
+
+void StationRegistry::work()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true)
+    {
+        this->condition.wait(lock, [this]
+                             { return this->stopping || !this->timers.empty(); });
+        if (this->stopping)
+            return;
+
+        // A station added meanwhile may be due sooner, so wait on the
+        // condition rather than sleeping through to this deadline.
+        auto deadline = this->timers.top().deadline;
+        if (std::chrono::steady_clock::now() < deadline)
+        {
+            this->condition.wait_until(lock, deadline);
+            continue;
+        }
+
+        Entry entry = this->timers.top();
+        this->timers.pop();
+        lock.unlock();
+
+        // The worker holding the entry is the queue's only owner until it
+        // goes back into the heap; other threads post() to it.
+        entry.deadline = entry.station->get_queue().update();
+
+        lock.lock();
+        this->timers.push(entry);
+        this->condition.notify_one();
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "audio_queue.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#define STATION_DEFAULT_NAME "main"
+#define STATION_SCHEDULER_DEFAULT_WORKERS 1
+
+// Named stations, each with its own AudioQueue, and the scheduler that
+// plays all of them. Every station sits in a single heap keyed by the time
+// its queue next needs an update(); the workers sleep until the earliest
+// deadline, run that station and put it back with the deadline update()
+// returned. A station is in the heap at most once, so it is never updated
+// by two workers at the same time.
+class StationRegistry
+{
+public:
+    StationRegistry(size_t workers = STATION_SCHEDULER_DEFAULT_WORKERS);
+    ~StationRegistry();
+
+    StationRegistry(const StationRegistry &) = delete;
+    StationRegistry &operator=(const StationRegistry &) = delete;
+
+    // Returns the existing station if name is taken.
+    std::shared_ptr<Station> create(const std::string &name);
+    // nullptr when there is no such station.
+    std::shared_ptr<Station> find(const std::string &name);
+    std::vector<std::string> names();
+
+private:
+    struct Entry
+    {
+        std::chrono::steady_clock::time_point deadline;
+        std::shared_ptr<Station> station;
+
+        bool operator>(const Entry &other) const { return this->deadline > other.deadline; }
+    };
+
+    void work();
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::map<std::string, std::shared_ptr<Station>> stations;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> timers;
+    std::vector<std::thread> workers;
+    bool stopping;
+};
@@ -0,0 +1,82 @@
+#include "track_cache.h"
+#include <sstream>
+#include <sys/stat.h>
+
+std::string TrackCache::key(const std::string &path, const std::string &variant)
+{
+    std::ostringstream key;
+    key << variant << '|' << path;
+
+    struct stat source;
+    if (stat(path.c_str(), &source) == 0)
+        key << '|' << source.st_size << '|' << source.st_mtim.tv_sec << '.' << source.st_mtim.tv_nsec;
+    return key.str();
+}
+
+std::shared_ptr<const DecodedTrack> TrackCache::get(const std::string &path, const std::string &variant, const std::function<std::shared_ptr<const DecodedTrack>()> &load)
+{
+    std::string key = this->key(path, variant);
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    auto it = this->entries.find(key);
+    if (it != this->entries.end())
+    {
+        this->counters.hits++;
+        this->lru.splice(this->lru.begin(), this->lru, it->second.lru);
+        auto track = it->second.track;
+        lock.unlock();
+        return track.get();
+    }
+
+    this->counters.misses++;
+    std::promise<std::shared_ptr<const DecodedTrack>> promise;
+    this->lru.push_front(key);
+    this->entries.emplace(key, Entry{promise.get_future().share(), 0, false, this->lru.begin()});
+    lock.unlock();
+
+    std::shared_ptr<const DecodedTrack> track = load();
+    promise.set_value(track);
+
+    lock.lock();
+    it = this->entries.find(key);
+    if (it == this->entries.end())
+        return track;
+
+    // Failed loads are not remembered, so the next request tries again.
+    if (track == nullptr)
+    {
+        this->lru.erase(it->second.lru);
+        this->entries.erase(it);
+        return track;
+    }
+
+    it->second.bytes = track->bytes;
+    it->second.loaded = true;
+    this->counters.bytes += track->bytes;
+    this->counters.tracks++;
+    this->evict();
+    return track;
+}
+
+void TrackCache::evict()
+{
+    for (auto it = this->lru.end(); it != this->lru.begin() && this->counters.bytes > this->budget;)
+    {
+        --it;
+        auto entry = this->entries.find(*it);
+        if (!entry->second.loaded || entry->second.track.get().use_count() > 1)
+            continue;
+
+        this->counters.bytes -= entry->second.bytes;
+        this->counters.tracks--;
+        this->counters.evictions++;
+        this->entries.erase(entry);
+        it = this->lru.erase(it);
+    }
+}
+
+TrackCacheStats TrackCache::stats()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    return this->counters;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "audio_file.h"
+#include <memory>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <future>
+#include <functional>
+
+#define TRACK_CACHE_DEFAULT_BUDGET (512ull * 1024 * 1024)
+
+struct TrackCacheStats
+{
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long evictions = 0;
+    size_t bytes = 0;
+    size_t tracks = 0;
+};
+
+// Process-wide cache of fully decoded tracks, keyed by path, output variant
+// and the file's size and mtime. Queue entries for the same file share one
+// DecodedTrack. Concurrent requests for a track that is still loading wait
+// for that load instead of starting a second one.
+//
+// When the cached bytes exceed the budget, least recently used tracks that
+// nothing references any more (no queue entry holds them) are evicted.
+// Tracks still in use are never dropped, so the budget can be overshot by
+// what is actually queued.
+class TrackCache
+{
+public:
+    TrackCache(size_t budget = TRACK_CACHE_DEFAULT_BUDGET) : budget(budget) {}
+
+    std::shared_ptr<const DecodedTrack> get(const std::string &path, const std::string &variant, const std::function<std::shared_ptr<const DecodedTrack>()> &load);
+
+    TrackCacheStats stats();
+
+private:
+    struct Entry
+    {
+        std::shared_future<std::shared_ptr<const DecodedTrack>> track;
+        size_t bytes;
+        bool loaded;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::string key(const std::string &path, const std::string &variant);
+    void evict();
+
+    std::mutex mutex;
+    size_t budget;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;
+    TrackCacheStats counters;
+};
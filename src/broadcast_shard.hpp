@@ -0,0 +1,125 @@
+#pragma once
+#ifndef BROADCAST_SHARD_H
+#define BROADCAST_SHARD_H
+
+#include "audio/audio_queue.h"
+#include "server_thread_interface.hpp"
+#include "reactor.hpp"
+#include "spsc_ring.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <string.h>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <stdexcept>
+
+#include <nlohmann/json.hpp>
+
+#define BROADCAST_SHARD_CAPACITY 256
+
+// The part of one station's audience served by one reactor. The station
+// sees a single listener per shard: its playback thread only pushes each
+// broadcast into the shard's ring and, if the reactor is not already on
+// its way, signals an eventfd. The reactor then delivers it to every
+// connection of the shard, so per-client work runs in parallel across
+// reactors instead of serially on the clock thread.
+class BroadcastShard : public BaseServerThread,
+                       public IAudioListener
+{
+public:
+    BroadcastShard() : event_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        if (this->event_.get() < 0)
+            throw std::runtime_error("Could not create shard event: " + std::string(strerror(errno)));
+    }
+
+    // Reactor thread only, like everything but the IAudioListener calls.
+    void add(std::weak_ptr<IAudioListener> listener) { this->listeners_.push_back(listener); }
+
+    int fd() override { return this->event_.get(); }
+    void on_readable() override;
+    bool yeet() override { return false; }
+
+    void on_audio_block(std::shared_ptr<AudioBroadcast> broadcast) override;
+    void on_queue_change(std::shared_ptr<QueueUpdate> update) override;
+
+    // Broadcasts lost to full rings, summed over every shard in the process.
+    static unsigned long long overflows() { return overflows_.load(); }
+
+private:
+    struct Message
+    {
+        std::shared_ptr<AudioBroadcast> broadcast;
+        std::shared_ptr<QueueUpdate> queue;
+    };
+
+    SocketRAII event_;
+    SpscRing<Message, BROADCAST_SHARD_CAPACITY> ring_;
+    std::atomic<bool> signaled_{false};
+    inline static std::atomic<unsigned long long> overflows_{0};
+    std::vector<std::weak_ptr<IAudioListener>> listeners_;
+
+    void publish(Message &message);
+};
+
+void BroadcastShard::publish(Message &message)
+{
+    // A reactor that stalls this long loses blocks rather than stalling playback.
+    if (!this->ring_.push(message))
+    {
+        overflows_++;
+        return;
+    }
+
+    if (this->signaled_.exchange(true))
+        return;
+    uint64_t one = 1;
+    if (write(this->event_.get(), &one, sizeof(one)) < 0 && errno != EAGAIN)
+        std::cerr << "Failed to signal shard: " << strerror(errno) << '\n';
+}
+
+void BroadcastShard::on_audio_block(std::shared_ptr<AudioBroadcast> broadcast)
+{
+    Message message{broadcast, nullptr};
+    this->publish(message);
+}
+
+void BroadcastShard::on_queue_change(std::shared_ptr<QueueUpdate> update)
+{
+    Message message{nullptr, update};
+    this->publish(message);
+}
+
+void BroadcastShard::on_readable()
+{
+    uint64_t count;
+    while (read(this->event_.get(), &count, sizeof(count)) > 0)
+        ;
+    // Cleared before draining, so anything pushed from here on signals again.
+    this->signaled_ = false;
+
+    Message message;
+    while (this->ring_.pop(message))
+    {
+        for (auto it = this->listeners_.begin(); it != this->listeners_.end();)
+        {
+            auto listener = it->lock();
+            if (listener == nullptr || listener->yeet())
+            {
+                it = this->listeners_.erase(it);
+                continue;
+            }
+
+            if (message.broadcast != nullptr)
+                listener->on_audio_block(message.broadcast);
+            else
+                listener->on_queue_change(message.queue);
+            ++it;
+        }
+    }
+}
+
+#endif // !BROADCAST_SHARD_H
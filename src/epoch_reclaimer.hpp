@@ -0,0 +1,87 @@
+#pragma once
+#ifndef EPOCH_RECLAIMER_H
+#define EPOCH_RECLAIMER_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Deferred deletion for structures that readers walk without a lock
+// (epoch-based reclamation with two reader counters). Readers hold a Guard
+// while they touch shared objects; a writer unlinks an object and retires
+// it, and it is deleted once every reader that could have seen it has left.
+// Neither side ever waits: a guard only bumps a counter, and a writer that
+// finds readers still inside keeps the object for a later retire().
+// Writers must be serialized among themselves; readers may be any number.
+template <typename T>
+class EpochReclaimer
+{
+public:
+    class Guard
+    {
+    public:
+        explicit Guard(EpochReclaimer &reclaimer) : reclaimer_(reclaimer)
+        {
+            // Count ourselves in the epoch we saw. If it moved on meanwhile,
+            // the writer may have missed us, so register again.
+            while (true)
+            {
+                this->epoch_ = reclaimer.epoch_.load();
+                reclaimer.readers_[this->epoch_ & 1].fetch_add(1);
+                if (reclaimer.epoch_.load() == this->epoch_)
+                    return;
+                reclaimer.readers_[this->epoch_ & 1].fetch_sub(1);
+            }
+        }
+
+        ~Guard() { this->reclaimer_.readers_[this->epoch_ & 1].fetch_sub(1); }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+    private:
+        EpochReclaimer &reclaimer_;
+        uint64_t epoch_;
+    };
+
+    EpochReclaimer() = default;
+
+    ~EpochReclaimer()
+    {
+        for (auto &retired : this->retired_)
+        {
+            for (const T *object : retired)
+                delete object;
+        }
+    }
+
+    EpochReclaimer(const EpochReclaimer &) = delete;
+    EpochReclaimer &operator=(const EpochReclaimer &) = delete;
+
+    // Writer only: deletes object, which is no longer reachable from the
+    // shared structure, as soon as no reader can still hold it.
+    void retire(const T *object)
+    {
+        uint64_t epoch = this->epoch_.load();
+        this->retired_[epoch & 1].push_back(object);
+
+        // Objects retired in the previous epoch were unlinked before anyone
+        // counted in this one arrived, so once the previous epoch's readers
+        // are gone they can go too, and the next epoch starts.
+        if (this->readers_[(epoch + 1) & 1].load() != 0)
+            return;
+        for (const T *old : this->retired_[(epoch + 1) & 1])
+            delete old;
+        this->retired_[(epoch + 1) & 1].clear();
+        this->epoch_.store(epoch + 1);
+    }
+
+private:
+    // Sequentially consistent throughout: a reader's registration and its
+    // loads must be ordered against the writer's unlink and counter check.
+    alignas(64) std::atomic<uint64_t> epoch_{0};
+    alignas(64) std::atomic<uint64_t> readers_[2] = {};
+    std::vector<const T *> retired_[2];
+};
+
+#endif // !EPOCH_RECLAIMER_H
@@ -0,0 +1,65 @@
+#pragma once
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// Unbounded multi-producer single-consumer queue (Vyukov's linked list).
+// Any number of threads may push at once, each with a single atomic
+// exchange; one thread pops. Neither side ever blocks. A push that is still
+// linking its node may stay invisible to pop() for a moment, after which it
+// is picked up by the next pop().
+template <typename T>
+class MpscQueue
+{
+public:
+    MpscQueue() : head_(new Node()), tail_(head_.load(std::memory_order_relaxed)) {}
+
+    ~MpscQueue()
+    {
+        T value;
+        while (this->pop(value))
+            ;
+        delete this->tail_;
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T value)
+    {
+        Node *node = new Node();
+        node->value = std::move(value);
+        Node *previous = this->head_.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // Consumer only.
+    bool pop(T &value)
+    {
+        Node *tail = this->tail_;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+            return false;
+
+        // next becomes the new stub; its value has been handed out.
+        value = std::move(next->value);
+        next->value = T();
+        this->tail_ = next;
+        delete tail;
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node *> next{nullptr};
+        T value;
+    };
+
+    alignas(64) std::atomic<Node *> head_;
+    alignas(64) Node *tail_;
+};
+
+#endif // !MPSC_QUEUE_H
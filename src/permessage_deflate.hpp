@@ -0,0 +1,127 @@
+#pragma once
+#ifndef PERMESSAGE_DEFLATE_H
+#define PERMESSAGE_DEFLATE_H
+
+// Standard
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sstream>
+
+// Compression
+#include <zlib.h>
+
+#define WEBSOCKET_DEFLATE_EXTENSION "permessage-deflate"
+// Messages shorter than this go out uncompressed.
+#define WEBSOCKET_DEFLATE_MIN_SIZE 128
+// Largest message a client may send compressed, once inflated.
+#define WEBSOCKET_DEFLATE_MAX_MESSAGE (1024 * 1024)
+#define WEBSOCKET_DEFLATE_WINDOW_BITS 15
+#define WEBSOCKET_DEFLATE_MEM_LEVEL 8
+
+// permessage-deflate (RFC 7692) as this server speaks it: no context
+// takeover in either direction. Every message is compressed on its own, so
+// a broadcast is compressed once and the same bytes go to every listener,
+// and a connection keeps no zlib state between messages.
+
+// Picks the first permessage-deflate offer in a Sec-WebSocket-Extensions
+// header we can accept and returns the response for it, or an empty string.
+// Offers that limit our window are declined: the shared payloads are
+// compressed with one window for everybody.
+inline std::string negotiate_deflate(const std::string &offered)
+{
+    std::stringstream offers(offered);
+    std::string offer;
+    while (std::getline(offers, offer, ','))
+    {
+        std::stringstream params(offer);
+        std::string param;
+        bool first = true;
+        bool acceptable = true;
+        while (std::getline(params, param, ';'))
+        {
+            param.erase(0, param.find_first_not_of(' '));
+            param.erase(param.find_last_not_of(' ') + 1);
+            std::string name = param.substr(0, param.find('='));
+            std::string value = param.find('=') == std::string::npos ? "" : param.substr(param.find('=') + 1);
+
+            if (first)
+                acceptable = name == WEBSOCKET_DEFLATE_EXTENSION;
+            else if (name == "server_max_window_bits")
+                acceptable = acceptable && value == std::to_string(WEBSOCKET_DEFLATE_WINDOW_BITS);
+            else if (name != "server_no_context_takeover" && name != "client_no_context_takeover" && name != "client_max_window_bits")
+                acceptable = false;
+            first = false;
+        }
+
+        if (acceptable)
+            return std::string(WEBSOCKET_DEFLATE_EXTENSION) + "; server_no_context_takeover; client_no_context_takeover";
+    }
+    return "";
+}
+
+// Compresses payload as one message. False if zlib fails, in which case
+// the message should be sent uncompressed.
+inline bool deflate_message(const std::string &payload, std::string &out)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -WEBSOCKET_DEFLATE_WINDOW_BITS, WEBSOCKET_DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    // Room for the sync flush marker on top of the bound.
+    out.resize(deflateBound(&stream, payload.size()) + 16);
+    stream.next_in = (Bytef *)payload.data();
+    stream.avail_in = payload.size();
+    stream.next_out = (Bytef *)&out[0];
+    stream.avail_out = out.size();
+
+    int result = deflate(&stream, Z_SYNC_FLUSH);
+    size_t written = out.size() - stream.avail_out;
+    deflateEnd(&stream);
+    if (result != Z_OK || stream.avail_in != 0 || stream.avail_out == 0 || written < 4)
+        return false;
+
+    // The sync flush ends in 00 00 ff ff, which the receiver puts back.
+    out.resize(written - 4);
+    return true;
+}
+
+// Inflates a message received with RSV1 set. False if it is corrupt or
+// inflates past WEBSOCKET_DEFLATE_MAX_MESSAGE.
+inline bool inflate_message(const char *data, size_t size, std::vector<char> &out)
+{
+    // The sender stripped the sync flush marker; feed it after the message.
+    static const char tail[] = {0x00, 0x00, (char)0xff, (char)0xff};
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -WEBSOCKET_DEFLATE_WINDOW_BITS) != Z_OK)
+        return false;
+
+    out.clear();
+    char chunk[16384];
+    int result = Z_OK;
+    const char *inputs[] = {data, tail};
+    size_t sizes[] = {size, sizeof(tail)};
+    for (int input = 0; input < 2 && (result == Z_OK || result == Z_BUF_ERROR); input++)
+    {
+        stream.next_in = (Bytef *)inputs[input];
+        stream.avail_in = sizes[input];
+        do
+        {
+            stream.next_out = (Bytef *)chunk;
+            stream.avail_out = sizeof(chunk);
+            result = inflate(&stream, Z_SYNC_FLUSH);
+            out.insert(out.end(), chunk, chunk + (sizeof(chunk) - stream.avail_out));
+            if (out.size() > WEBSOCKET_DEFLATE_MAX_MESSAGE)
+                result = Z_MEM_ERROR;
+        } while (result == Z_OK && (stream.avail_in > 0 || stream.avail_out == 0));
+    }
+    inflateEnd(&stream);
+
+    // Z_BUF_ERROR only means there was nothing left to do.
+    return (result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR) && stream.avail_in == 0;
+}
+
+#endif // !PERMESSAGE_DEFLATE_H
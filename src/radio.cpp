@@ -1,12 +1,19 @@
 #include "server.hpp"
 #include <memory>
 #include <thread>
+#include <sstream>
+#include <string>
 
 #include "audio/audio_queue.h"
 #include "audio/audio_file.h"
+#include "audio/pcm_cache.h"
+#include "audio/track_cache.h"
+#include "audio/station_registry.h"
 
 #include <signal.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 
 int main()
 {
@@ -16,38 +23,78 @@ int main()
     sigpipe_action.sa_flags = 0;
     sigaction(SIGPIPE, &sigpipe_action, NULL);
 
-    std::shared_ptr<AudioQueueRwLock> queue = std::make_shared<AudioQueueRwLock>();
+    // SK2_STATIONS=jazz,rock adds stations, served at /station/<name>, next
+    // to the default one. Every station plays the same playlist.
+    std::shared_ptr<StationRegistry> stations = std::make_shared<StationRegistry>();
+    stations->create(STATION_DEFAULT_NAME);
+    const char *station_names = getenv("SK2_STATIONS");
+    if (station_names != NULL)
+    {
+        std::stringstream names(station_names);
+        std::string name;
+        while (std::getline(names, name, ','))
+        {
+            if (!name.empty())
+                stations->create(name);
+        }
+    }
 
-    std::shared_ptr<Server> server = Server::Create(3030, queue);
+    // SK2_SEND_PATH=write|zerocopy|io_uring; the last two need the matching
+    // build flag (see the Makefile) and fall back to write otherwise.
+    ServerOptions server_options;
+    const char *send_path = getenv("SK2_SEND_PATH");
+    if (send_path != NULL && !send_path_from_name(send_path, server_options.send_path))
+        std::cerr << "Unknown SK2_SEND_PATH " << send_path << ", sending with write()" << std::endl;
+
+    std::shared_ptr<Server> server = Server::Create(3030, stations, server_options);
     if (server == nullptr)
         return 1;
 
-    std::thread server_thread(&Server::start_listening, server);
-    server_thread.detach();
-
-    std::shared_ptr<AudioFile> file = std::make_shared<AudioFile>("Captain.mp3");
-    std::shared_ptr<AudioFile> file2 = std::make_shared<AudioFile>("Guy.mp3");
-    std::shared_ptr<AudioFile> file3 = std::make_shared<AudioFile>("Africa.mp3");
-    std::shared_ptr<AudioFile> file4 = std::make_shared<AudioFile>("Rainbow.mp3");
-    std::shared_ptr<AudioFile> file5 = std::make_shared<AudioFile>("Rick.mp3");
-    std::shared_ptr<AudioFile> file6 = std::make_shared<AudioFile>("Take.mp3");
-
-    queue->lock_write();
-    queue->get_queue().push(file);
-    queue->get_queue().push(file2);
-    queue->get_queue().push(file3);
-    queue->get_queue().push(file4);
-    queue->get_queue().push(file5);
-    queue->get_queue().push(file6);
-    queue->unlock_write();
-
-    while (true)
+    AudioFileOptions options;
+    options.streaming = true;
+    options.cache = std::make_shared<PcmCache>(".pcm-cache");
+    // SK2_TRACK_CACHE_MB caps the decoded tracks kept for reuse.
+    size_t track_budget = TRACK_CACHE_DEFAULT_BUDGET;
+    const char *track_cache_mb = getenv("SK2_TRACK_CACHE_MB");
+    if (track_cache_mb != NULL && atoll(track_cache_mb) > 0)
+        track_budget = (size_t)atoll(track_cache_mb) * 1024 * 1024;
+    options.tracks = std::make_shared<TrackCache>(track_budget);
+
+    // SK2_OUTPUT_CODEC=opus encodes the station once for all listeners,
+    // at SK2_OPUS_BITRATE bits per second; the default sends PCM.
+    AudioCodec codec = AudioCodec::PCM;
+    int bitrate = OPUS_STAGE_DEFAULT_BITRATE;
+    const char *output_codec = getenv("SK2_OUTPUT_CODEC");
+    if (output_codec != NULL && strcmp(output_codec, "opus") == 0)
+        codec = AudioCodec::OPUS;
+    const char *opus_bitrate = getenv("SK2_OPUS_BITRATE");
+    if (opus_bitrate != NULL && atoi(opus_bitrate) > 0)
+        bitrate = atoi(opus_bitrate);
+
+    // SK2_JOIN_BURST is the seconds of recent audio sent to a new listener.
+    double join_burst = BROADCAST_HISTORY_DEFAULT_BURST;
+    const char *join_burst_env = getenv("SK2_JOIN_BURST");
+    if (join_burst_env != NULL && atof(join_burst_env) >= 0)
+        join_burst = atof(join_burst_env);
+
+    // Stations are already playing on the scheduler, which owns their
+    // queues. Each gets entries of its own; decoded tracks are shared
+    // through the track cache.
+    const char *playlist[] = {"Captain.mp3", "Guy.mp3", "Africa.mp3", "Rainbow.mp3", "Rick.mp3", "Take.mp3"};
+    for (auto &name : stations->names())
     {
-        queue->lock_write();
-        queue->get_queue().update();
-        queue->unlock_write();
+        stations->find(name)->get_queue().post([=](AudioQueue &queue)
+                                               {
+                                                   queue.set_file_options(options);
+                                                   queue.set_output_codec(codec, bitrate);
+                                                   queue.set_join_burst(join_burst);
+                                                   for (const char *filename : playlist)
+                                                       queue.push(std::make_shared<AudioFile>(filename, options)); });
     }
 
+    // Playback runs on the registry's scheduler; this thread accepts connections.
+    server->start_listening();
+
     return 0;
 }
 
@@ -56,6 +103,7 @@ void AudioQueue::rewind()
     if (this->audio_files.size() == 0)
         return;
     auto file = this->audio_files[0];
+    this->reset_mixer();
     file->rewind();
-    this->update_listeners_queue(this->queue_info());
+    this->mark_changed();
 }
\ No newline at end of file
@@ -0,0 +1,277 @@
+#pragma once
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "connection_utilities.hpp"
+#include "server_thread_interface.hpp"
+#include "send_path.hpp"
+
+// Network
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Standard
+#include <unistd.h>
+#include <string.h>
+#include <iostream>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <thread>
+
+// Error handling
+#include <stdexcept>
+#include <cerrno>
+
+#define REACTOR_MAX_EVENTS 256
+// How often a reactor drops connections the playback side gave up on.
+#define REACTOR_SWEEP_INTERVAL_MS 1000
+
+// One edge-triggered epoll loop on its own thread. Every reactor watches the
+// shared listening socket (EPOLLEXCLUSIVE, so a connection wakes only one of
+// them), accepts until the backlog is drained and then serves the
+// connections it accepted for their whole life: the HTTP upgrade, WebSocket
+// reads and flushing writes. Handlers run only on their reactor's thread;
+// other threads queue output on a handler and wake() the reactor to flush.
+class Reactor
+{
+public:
+    typedef std::function<std::shared_ptr<BaseServerThread>(std::unique_ptr<ClientConnectionMetadata>, Reactor *)> AcceptHandler;
+
+    Reactor(int listen_fd, AcceptHandler on_accept, SendPathKind send_path = SendPathKind::WRITE) : epoll_(epoll_create1(EPOLL_CLOEXEC)), wakeup_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), listen_fd_(listen_fd), on_accept_(on_accept), send_path_(send_path)
+    {
+        if (this->epoll_.get() < 0 || this->wakeup_.get() < 0)
+            throw std::runtime_error("Could not create epoll instance: " + std::string(strerror(errno)));
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+        event.data.fd = this->listen_fd_;
+        if (epoll_ctl(this->epoll_.get(), EPOLL_CTL_ADD, this->listen_fd_, &event) < 0)
+            throw std::runtime_error("Could not watch listening socket: " + std::string(strerror(errno)));
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = this->wakeup_.get();
+        if (epoll_ctl(this->epoll_.get(), EPOLL_CTL_ADD, this->wakeup_.get(), &event) < 0)
+            throw std::runtime_error("Could not watch wakeup event: " + std::string(strerror(errno)));
+
+        if (this->send_path_.completion_fd() >= 0)
+        {
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.fd = this->send_path_.completion_fd();
+            if (epoll_ctl(this->epoll_.get(), EPOLL_CTL_ADD, this->send_path_.completion_fd(), &event) < 0)
+                throw std::runtime_error("Could not watch send completions: " + std::string(strerror(errno)));
+        }
+    }
+
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    void run();
+
+    // Makes handler the one serving its socket, e.g. after an upgrade.
+    // Only called from this reactor's thread.
+    void adopt(std::shared_ptr<BaseServerThread> handler) { this->handlers_[handler->fd()] = handler; }
+
+    // Has the reactor call on_writable() for fd soon. Safe from any thread.
+    void wake(int fd);
+
+    // Serves a handler on a descriptor of its own (not an accepted socket,
+    // e.g. an eventfd), calling on_readable() whenever it becomes readable.
+    // Only called from this reactor's thread.
+    void watch(std::shared_ptr<BaseServerThread> handler);
+
+    bool on_reactor_thread() { return std::this_thread::get_id() == this->thread_; }
+
+    SendPath &send_path() { return this->send_path_; }
+
+private:
+    SocketRAII epoll_;
+    SocketRAII wakeup_;
+    int listen_fd_;
+    AcceptHandler on_accept_;
+    SendPath send_path_;
+    std::unordered_map<int, std::shared_ptr<BaseServerThread>> handlers_;
+    std::chrono::steady_clock::time_point last_sweep_ = std::chrono::steady_clock::now();
+    std::thread::id thread_;
+
+    std::mutex wake_mutex_;
+    std::vector<int> woken_;
+    bool wake_pending_ = false;
+
+    void accept_all();
+    void flush_woken();
+    void dispatch(int fd, uint32_t events);
+    void remove(int fd);
+    void sweep();
+};
+
+void Reactor::run()
+{
+    this->thread_ = std::this_thread::get_id();
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while (true)
+    {
+        int count = epoll_wait(this->epoll_.get(), events, REACTOR_MAX_EVENTS, REACTOR_SWEEP_INTERVAL_MS);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "epoll_wait failed: " << strerror(errno) << '\n';
+            return;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.fd == this->listen_fd_)
+                this->accept_all();
+            else if (events[i].data.fd == this->wakeup_.get())
+                this->flush_woken();
+            else if (events[i].data.fd == this->send_path_.completion_fd())
+                this->send_path_.reap();
+            else
+                this->dispatch(events[i].data.fd, events[i].events);
+        }
+
+        // Everything the handlers queued in this pass goes out in one batch.
+        this->send_path_.submit();
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - this->last_sweep_ >= std::chrono::milliseconds(REACTOR_SWEEP_INTERVAL_MS))
+        {
+            this->sweep();
+            this->last_sweep_ = now;
+        }
+    }
+}
+
+void Reactor::wake(int fd)
+{
+    {
+        std::unique_lock<std::mutex> lock(this->wake_mutex_);
+        this->woken_.push_back(fd);
+        if (this->wake_pending_)
+            return;
+        this->wake_pending_ = true;
+    }
+
+    uint64_t one = 1;
+    if (write(this->wakeup_.get(), &one, sizeof(one)) < 0 && errno != EAGAIN)
+        std::cerr << "Failed to wake reactor: " << strerror(errno) << '\n';
+}
+
+void Reactor::watch(std::shared_ptr<BaseServerThread> handler)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = handler->fd();
+    if (epoll_ctl(this->epoll_.get(), EPOLL_CTL_ADD, handler->fd(), &event) < 0)
+    {
+        std::cerr << "Could not watch handler: " << strerror(errno) << '\n';
+        return;
+    }
+    this->adopt(handler);
+}
+
+void Reactor::flush_woken()
+{
+    uint64_t count;
+    while (read(this->wakeup_.get(), &count, sizeof(count)) > 0)
+        ;
+
+    std::vector<int> woken;
+    {
+        std::unique_lock<std::mutex> lock(this->wake_mutex_);
+        woken.swap(this->woken_);
+        this->wake_pending_ = false;
+    }
+
+    for (int fd : woken)
+        this->dispatch(fd, EPOLLOUT);
+}
+
+void Reactor::accept_all()
+{
+    while (true)
+    {
+        struct sockaddr_in clientAddress;
+        socklen_t clientAddressLength = sizeof(clientAddress);
+        memset(&clientAddress, 0, sizeof(clientAddress));
+        int clientSocket = accept4(this->listen_fd_, (struct sockaddr *)&clientAddress, &clientAddressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                std::cerr << "Failed to accept connection: " << strerror(errno) << '\n';
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        auto client = std::make_unique<ClientConnectionMetadata>(clientSocket, clientAddress);
+#ifdef DEBUG
+        std::cout << "Connection accepted from " << inet_ntoa(client->address.sin_addr) << ":" << ntohs(client->address.sin_port) << '\n';
+#endif
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = clientSocket;
+        if (epoll_ctl(this->epoll_.get(), EPOLL_CTL_ADD, clientSocket, &event) < 0)
+        {
+            std::cerr << "Could not watch connection: " << strerror(errno) << '\n';
+            continue;
+        }
+
+        this->handlers_[clientSocket] = this->on_accept_(std::move(client), this);
+    }
+}
+
+void Reactor::dispatch(int fd, uint32_t events)
+{
+    auto it = this->handlers_.find(fd);
+    if (it == this->handlers_.end())
+        return;
+
+    // The handler may replace itself through adopt(); keep it alive meanwhile.
+    std::shared_ptr<BaseServerThread> handler = it->second;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        handler->on_readable();
+    if (events & EPOLLOUT)
+        handler->on_writable();
+
+    it = this->handlers_.find(fd);
+    if (it != this->handlers_.end() && it->second->yeet())
+        this->remove(fd);
+}
+
+void Reactor::remove(int fd)
+{
+    epoll_ctl(this->epoll_.get(), EPOLL_CTL_DEL, fd, NULL);
+    this->handlers_.erase(fd);
+}
+
+void Reactor::sweep()
+{
+    for (auto it = this->handlers_.begin(); it != this->handlers_.end();)
+    {
+        if (it->second->yeet())
+        {
+            epoll_ctl(this->epoll_.get(), EPOLL_CTL_DEL, it->first, NULL);
+            it = this->handlers_.erase(it);
+            continue;
+        }
+        ++it;
+    }
+}
+
+#endif // !REACTOR_H
@@ -0,0 +1,237 @@
+#pragma once
+#ifndef SEND_PATH_H
+#define SEND_PATH_H
+
+// Network
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/errqueue.h>
+
+// Standard
+#include <unistd.h>
+#include <string.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <deque>
+#include <cerrno>
+#include <cstdint>
+
+#ifdef SK2_IO_URING
+#include <liburing.h>
+#endif
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#define SEND_PATH_URING_ENTRIES 4096
+
+// How a reactor puts frames on its sockets.
+enum class SendPathKind
+{
+    // Plain non-blocking write().
+    WRITE,
+    // send() with MSG_ZEROCOPY; the frame stays referenced until the kernel
+    // reports on the socket's error queue that it is done with the pages.
+    // Built with -DSK2_ZEROCOPY.
+    ZEROCOPY,
+    // Sends queued on an io_uring and submitted in one batch per reactor
+    // pass; the frame stays referenced until its completion is reaped.
+    // Built with -DSK2_IO_URING (liburing).
+    IO_URING
+};
+
+inline const char *send_path_name(SendPathKind kind)
+{
+    switch (kind)
+    {
+    case SendPathKind::ZEROCOPY:
+        return "zerocopy";
+    case SendPathKind::IO_URING:
+        return "io_uring";
+    default:
+        return "write";
+    }
+}
+
+// Parses a send path name as printed by send_path_name(). False if name is
+// not one of them; kind is left untouched then.
+inline bool send_path_from_name(const std::string &name, SendPathKind &kind)
+{
+    for (SendPathKind candidate : {SendPathKind::WRITE, SendPathKind::ZEROCOPY, SendPathKind::IO_URING})
+    {
+        if (name == send_path_name(candidate))
+        {
+            kind = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Receives the result of an asynchronous send: bytes sent or -errno.
+class ISendTarget
+{
+public:
+    virtual void on_send_complete(ssize_t result) = 0;
+    virtual ~ISendTarget() {}
+};
+
+// Per-reactor send backend. Falls back to WRITE when the requested kind is
+// not compiled in or the kernel refuses it, so callers only need to check
+// kind() once.
+class SendPath
+{
+public:
+    SendPath(SendPathKind requested);
+    ~SendPath();
+
+    SendPath(const SendPath &) = delete;
+    SendPath &operator=(const SendPath &) = delete;
+
+    SendPathKind kind() { return this->kind_; }
+
+    // Descriptor the reactor watches for io_uring completions, -1 otherwise.
+    int completion_fd() { return this->completion_fd_; }
+
+    // IO_URING only: queues a send of size bytes at data, keeping frame
+    // alive until target has been told the result. False if the submission
+    // queue has no room; target is not called and should retry later.
+    bool queue_send(int fd, const char *data, size_t size, std::shared_ptr<ISendTarget> target, std::shared_ptr<const std::vector<char>> frame);
+    // Submits everything queued since the last call in one syscall.
+    void submit();
+    // Delivers finished sends to their targets.
+    void reap();
+
+private:
+    SendPathKind kind_;
+    int completion_fd_;
+
+#ifdef SK2_IO_URING
+    struct PendingSend
+    {
+        std::shared_ptr<ISendTarget> target;
+        std::shared_ptr<const std::vector<char>> frame;
+    };
+
+    struct io_uring ring_;
+    unsigned queued_ = 0;
+#endif
+};
+
+SendPath::SendPath(SendPathKind requested)
+{
+    this->kind_ = SendPathKind::WRITE;
+    this->completion_fd_ = -1;
+
+    if (requested == SendPathKind::ZEROCOPY)
+    {
+#ifdef SK2_ZEROCOPY
+        // Support is per socket; connections check SO_ZEROCOPY themselves.
+        this->kind_ = SendPathKind::ZEROCOPY;
+#else
+        std::cerr << "Built without SK2_ZEROCOPY, sending with write()" << std::endl;
+#endif
+    }
+
+    if (requested == SendPathKind::IO_URING)
+    {
+#ifdef SK2_IO_URING
+        int result = io_uring_queue_init(SEND_PATH_URING_ENTRIES, &this->ring_, 0);
+        if (result < 0)
+        {
+            std::cerr << "io_uring unavailable (" << strerror(-result) << "), sending with write()" << std::endl;
+            return;
+        }
+
+        this->completion_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (this->completion_fd_ < 0 || io_uring_register_eventfd(&this->ring_, this->completion_fd_) < 0)
+        {
+            std::cerr << "Could not register io_uring completions, sending with write()" << std::endl;
+            if (this->completion_fd_ >= 0)
+                close(this->completion_fd_);
+            this->completion_fd_ = -1;
+            io_uring_queue_exit(&this->ring_);
+            return;
+        }
+        this->kind_ = SendPathKind::IO_URING;
+#else
+        std::cerr << "Built without SK2_IO_URING, sending with write()" << std::endl;
+#endif
+    }
+}
+
+SendPath::~SendPath()
+{
+#ifdef SK2_IO_URING
+    if (this->kind_ == SendPathKind::IO_URING)
+    {
+        io_uring_queue_exit(&this->ring_);
+        close(this->completion_fd_);
+    }
+#endif
+}
+
+bool SendPath::queue_send([[maybe_unused]] int fd, [[maybe_unused]] const char *data, [[maybe_unused]] size_t size,
+                          [[maybe_unused]] std::shared_ptr<ISendTarget> target, [[maybe_unused]] std::shared_ptr<const std::vector<char>> frame)
+{
+#ifdef SK2_IO_URING
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&this->ring_);
+    if (sqe == NULL)
+    {
+        // Submission queue full: push out what is there and retry.
+        this->submit();
+        sqe = io_uring_get_sqe(&this->ring_);
+    }
+    if (sqe == NULL)
+        return false;
+
+    io_uring_prep_send(sqe, fd, data, size, MSG_NOSIGNAL);
+    io_uring_sqe_set_data(sqe, new PendingSend{target, frame});
+    this->queued_++;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void SendPath::submit()
+{
+#ifdef SK2_IO_URING
+    if (this->kind_ != SendPathKind::IO_URING || this->queued_ == 0)
+        return;
+    int result = io_uring_submit(&this->ring_);
+    if (result < 0)
+        std::cerr << "io_uring_submit failed: " << strerror(-result) << std::endl;
+    this->queued_ = 0;
+#endif
+}
+
+void SendPath::reap()
+{
+#ifdef SK2_IO_URING
+    uint64_t count;
+    while (read(this->completion_fd_, &count, sizeof(count)) > 0)
+        ;
+
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(&this->ring_, &cqe) == 0)
+    {
+        PendingSend *pending = (PendingSend *)io_uring_cqe_get_data(cqe);
+        ssize_t result = cqe->res;
+        io_uring_cqe_seen(&this->ring_, cqe);
+
+        // Dropping pending releases the frame reference.
+        pending->target->on_send_complete(result);
+        delete pending;
+    }
+#endif
+}
+
+#endif // !SEND_PATH_H
@@ -6,12 +6,15 @@
 
 #include "audio/audio_queue.h"
 #include "audio/audio_file.h"
+#include "audio/station_registry.h"
 
 #include "connection_utilities.hpp"
 #include "server_thread_interface.hpp"
 #include "websocket_server_interface.hpp"
 #include "server_thread.hpp"
 #include "websocket_server_thread.hpp"
+#include "reactor.hpp"
+#include "broadcast_shard.hpp"
 
 // Network
 #include <sys/types.h>
@@ -25,6 +28,12 @@
 #include <iostream>
 #include <memory>
 #include <vector>
+#include <thread>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
 
 // Error handling
 #include <stdexcept>
@@ -58,38 +67,73 @@ protected:
     sockaddr_in address;
 };
 
+#define SERVER_DEFAULT_BACKLOG 1024
+
+struct ServerOptions
+{
+    int backlog = SERVER_DEFAULT_BACKLOG;
+    // 0 runs one reactor per core.
+    size_t reactors = 0;
+    ListenerOptions listener;
+    // Falls back to WRITE when not built in or not supported by the kernel.
+    SendPathKind send_path = SendPathKind::WRITE;
+};
+
 class Server : private ServerSocket, public BaseWebsocketServer
 {
 public:
-    Server(int port, std::shared_ptr<AudioQueueRwLock> queue) : ServerSocket(port), queue_(queue)
+    Server(int port, std::shared_ptr<StationRegistry> stations, int backlog) : ServerSocket(port), stations_(stations)
     {
-        if (listen(this->socketRAII_.get(), 10) < 0)
+        if (listen(this->socketRAII_.get(), backlog) < 0)
             throw std::runtime_error("Could not listen on socket");
-    };
 
-    static std::shared_ptr<Server> Create(int port, std::shared_ptr<AudioQueueRwLock> queue);
+        // Reactors drain accept() until EAGAIN.
+        int flags = fcntl(this->socketRAII_.get(), F_GETFL, 0);
+        if (flags < 0 || fcntl(this->socketRAII_.get(), F_SETFL, flags | O_NONBLOCK) < 0)
+            throw std::runtime_error("Could not make listening socket non-blocking");
+    };
 
-    std::unique_ptr<ClientConnectionMetadata> checkSocket();
+    static std::shared_ptr<Server> Create(int port, std::shared_ptr<StationRegistry> stations, ServerOptions options = ServerOptions());
 
+    // Serves connections on the reactors; the calling thread runs one of them.
     void start_listening();
 
-    void upgrade(std::shared_ptr<WebsocketServerThread> thread) override;
+    void upgrade(std::shared_ptr<WebsocketServerThread> thread, std::shared_ptr<Station> station) override;
 
     using ServerSocket::address;
     using ServerSocket::socketRAII_;
 
 private:
-    std::vector<std::shared_ptr<BaseServerThread>> threads_;
     std::weak_ptr<Server> self_;
-    std::shared_ptr<AudioQueueRwLock> queue_;
+    std::shared_ptr<StationRegistry> stations_;
+    std::vector<std::unique_ptr<Reactor>> reactors_;
+
+    // One shard per station and reactor, created on the first upgrade.
+    std::mutex shards_mutex_;
+    std::map<std::pair<Reactor *, Station *>, std::shared_ptr<BroadcastShard>> shards_;
+
+    static void pin_to_core(size_t core);
 };
 
-std::shared_ptr<Server> Server::Create(int port, std::shared_ptr<AudioQueueRwLock> queue)
+std::shared_ptr<Server> Server::Create(int port, std::shared_ptr<StationRegistry> stations, ServerOptions options)
 {
     try
     {
-        std::shared_ptr<Server> server = std::shared_ptr<Server>(new Server(port, queue));
+        std::shared_ptr<Server> server = std::shared_ptr<Server>(new Server(port, stations, options.backlog));
         server->self_ = server;
+
+        size_t reactors = options.reactors;
+        if (reactors == 0)
+            reactors = std::max(1u, std::thread::hardware_concurrency());
+        std::weak_ptr<Server> self = server;
+        std::weak_ptr<StationRegistry> registry = stations;
+        ListenerOptions listener = options.listener;
+        for (size_t i = 0; i < reactors; i++)
+            server->reactors_.push_back(std::make_unique<Reactor>(
+                server->socketRAII_.get(), [self, registry, listener](std::unique_ptr<ClientConnectionMetadata> client, Reactor *reactor)
+                { return std::make_shared<ServerThread>(std::move(client), self, registry, reactor, listener); },
+                options.send_path));
+        std::cout << "Serving on " << reactors << " reactors, sending with " << send_path_name(server->reactors_[0]->send_path().kind()) << std::endl;
         return server;
     }
     catch (const std::exception &e)
@@ -99,56 +143,61 @@ std::shared_ptr<Server> Server::Create(int port, std::shared_ptr<AudioQueueRwLoc
     }
 };
 
-std::unique_ptr<ClientConnectionMetadata> Server::checkSocket()
+void Server::pin_to_core(size_t core)
 {
-    struct sockaddr_in clientAddress;
-    socklen_t clientAddressLength = sizeof(clientAddress);
-    memset(&clientAddress, 0, sizeof(clientAddress));
-    int clientSocket = accept(this->socketRAII_.get(), (struct sockaddr *)&clientAddress, &clientAddressLength);
-
-    if (clientSocket == -1)
-        throw std::runtime_error("Could not accept connection: " + std::string(strerror(errno)));
-
-    return std::make_unique<ClientConnectionMetadata>(clientSocket, clientAddress);
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % cores, &set);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (result != 0)
+        std::cerr << "Could not pin reactor to core " << core % cores << ": " << strerror(result) << '\n';
 }
 
 void Server::start_listening()
 {
-    while (true)
-    {
-
-        try
-        {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < this->reactors_.size(); i++)
+        threads.emplace_back([this, i]()
+                             {
+                                 pin_to_core(i);
+                                 this->reactors_[i]->run(); });
+
+    pin_to_core(0);
+    this->reactors_[0]->run();
+
+    for (auto &thread : threads)
+        thread.join();
+}
 
-            for (auto it = this->threads_.begin(); it != this->threads_.end();)
-            {
-                if ((*it)->yeet())
-                {
-                    it = this->threads_.erase(it);
-                    continue;
-                }
-                it++;
-            }
-            std::unique_ptr<ClientConnectionMetadata> client = this->checkSocket();
-#ifdef DEBUG
-            std::cout << "Connection accepted from " << inet_ntoa(client->address.sin_addr) << ":" << ntohs(client->address.sin_port) << '\n';
-#endif
-
-            this->threads_.emplace_back(std::make_shared<ServerThread>(std::move(client), this->self_, this->queue_));
-        }
-        catch (const std::exception &e)
+void Server::upgrade(std::shared_ptr<WebsocketServerThread> thread, std::shared_ptr<Station> station)
+{
+    // Runs on the thread's reactor, which is the only one touching its shard.
+    Reactor *reactor = thread->reactor();
+    std::shared_ptr<BroadcastShard> shard;
+    bool created = false;
+    {
+        std::unique_lock<std::mutex> lock(this->shards_mutex_);
+        auto &slot = this->shards_[std::make_pair(reactor, station.get())];
+        if (slot == nullptr)
         {
-            std::cerr << "Failed to accept connection: " << e.what() << '\n';
+            slot = std::make_shared<BroadcastShard>();
+            created = true;
         }
+        shard = slot;
     }
-}
-
-void Server::upgrade(std::shared_ptr<WebsocketServerThread> thread)
-{
-    this->queue_->lock_write();
-    this->queue_->get_queue().subscribe(thread);
-    this->threads_.emplace_back(thread);
-    this->queue_->unlock_write();
+    if (created)
+        reactor->watch(shard);
+
+    // Nothing here waits for the playback thread: this only reads published
+    // snapshots and posts the queue snapshot request. Blocks and deltas
+    // emitted meanwhile wait in the shard until this reactor drains it,
+    // after the add, and sequence numbers and versions weed out ones the
+    // client already has.
+    if (created)
+        station->get_queue().subscribe(shard);
+    station->get_queue().catch_up(thread);
+    shard->add(thread);
 }
 
 #endif // !SERVER_H
\ No newline at end of file
@@ -4,12 +4,15 @@
 
 #include "audio/audio_queue.h"
 #include "audio/audio_file.h"
+#include "audio/station_registry.h"
 
 #include "connection_utilities.hpp"
 #include "websocket_server_interface.hpp"
 #include "websocket_server_thread.hpp"
 #include "server_thread_interface.hpp"
 #include "server.hpp"
+#include "reactor.hpp"
+#include "permessage_deflate.hpp"
 
 // networking
 #include <sys/types.h>
@@ -104,12 +107,9 @@ private:
 class ServerThread : public BaseServerThread
 {
 public:
-    ServerThread(std::unique_ptr<ClientConnectionMetadata> connectionMetadata, std::weak_ptr<BaseWebsocketServer> server, std::weak_ptr<AudioQueueRwLock> queue) : connectionMetadata_(std::move(connectionMetadata)), server_(server), queue_(queue)
-    {
-        std::thread thread(&ServerThread::start_handling, this);
-        thread.detach();
-    }
-    void start_handling() override;
+    ServerThread(std::unique_ptr<ClientConnectionMetadata> connectionMetadata, std::weak_ptr<BaseWebsocketServer> server, std::weak_ptr<StationRegistry> stations, Reactor *reactor, ListenerOptions listener_options) : connectionMetadata_(std::move(connectionMetadata)), server_(server), stations_(stations), reactor_(reactor), listener_options_(listener_options), fd_(connectionMetadata_->get()) {}
+    int fd() override { return fd_; }
+    void on_readable() override;
     bool yeet() override { return yeet_flag; }
 
     ~ServerThread() override
@@ -121,7 +121,13 @@ private:
     bool yeet_flag = false;
     std::unique_ptr<ClientConnectionMetadata> connectionMetadata_;
     std::weak_ptr<BaseWebsocketServer> server_;
-    std::weak_ptr<AudioQueueRwLock> queue_;
+    std::weak_ptr<StationRegistry> stations_;
+    Reactor *reactor_;
+    ListenerOptions listener_options_;
+    int fd_;
+    std::string request_;
+
+    void handle_request(char *request);
 
     bool is_upgrade_request(HttpParsed &httpParsed)
     {
@@ -135,14 +141,52 @@ private:
 
     std::string computeWebsocketAcceptKey(const std::string &websocketKey);
 
-    std::string buildUpgradeResponse(const std::string &websocketAcceptKey)
+    // /station/<name> picks a station; any other path gets the default one.
+    std::shared_ptr<Station> select_station(HttpParsed &httpParsed)
     {
-        std::string response = "HTTP/1.1 101 Switching Protocols\r\n";
-        response += "Upgrade: websocket\r\n";
-        response += "Connection: Upgrade\r\n";
-        response += "Sec-WebSocket-Accept: " + websocketAcceptKey + "\r\n";
-        response += "\r\n";
-        return response;
+        auto stations = this->stations_.lock();
+        if (stations == nullptr)
+            return nullptr;
+
+        const std::string prefix = "/station/";
+        std::string path = httpParsed.path.substr(0, httpParsed.path.find('?'));
+        if (path.compare(0, prefix.length(), prefix) != 0)
+            return stations->find(STATION_DEFAULT_NAME);
+
+        std::string name = path.substr(prefix.length());
+        name = name.substr(0, name.find('/'));
+        return stations->find(name);
+    }
+
+    // Returns the subprotocol to accept, or an empty string when the client
+    // offered none we speak.
+    std::string select_protocol(HttpParsed &httpParsed)
+    {
+        auto it = httpParsed.headers.find("Sec-WebSocket-Protocol");
+        if (it == httpParsed.headers.end())
+            return "";
+
+        std::string offered = *it;
+        std::stringstream offered_stream(offered);
+        std::string protocol;
+        while (std::getline(offered_stream, protocol, ','))
+        {
+            protocol.erase(0, protocol.find_first_not_of(' '));
+            protocol.erase(protocol.find_last_not_of(' ') + 1);
+            if (protocol == WEBSOCKET_BINARY_AUDIO_PROTOCOL)
+                return protocol;
+        }
+        return "";
+    }
+
+    // Returns the Sec-WebSocket-Extensions response, empty when the client
+    // offered no permessage-deflate we accept.
+    std::string select_extensions(HttpParsed &httpParsed)
+    {
+        auto it = httpParsed.headers.find("Sec-WebSocket-Extensions");
+        if (it == httpParsed.headers.end())
+            return "";
+        return negotiate_deflate(*it);
     }
 };
 
@@ -175,53 +219,97 @@ std::string ServerThread::computeWebsocketAcceptKey(const std::string &websocket
     return base64_encoded;
 }
 
-std::string buildUpgradeResponse(const std::string &websocketAcceptKey)
+// protocol and extensions are left out of the response when empty.
+std::string buildUpgradeResponse(const std::string &websocketAcceptKey, const std::string &protocol, const std::string &extensions)
 {
     std::string response = "HTTP/1.1 101 Switching Protocols\r\n";
     response += "Upgrade: websocket\r\n";
     response += "Connection: Upgrade\r\n";
     response += "Sec-WebSocket-Accept: " + websocketAcceptKey + "\r\n";
+    if (!protocol.empty())
+        response += "Sec-WebSocket-Protocol: " + protocol + "\r\n";
+    if (!extensions.empty())
+        response += "Sec-WebSocket-Extensions: " + extensions + "\r\n";
     response += "\r\n";
     return response;
 }
 
-void ServerThread::start_handling()
+void ServerThread::on_readable()
 {
-    char buffer[4096] = {0};
+    char buffer[4096];
     while (this->yeet_flag == false)
     {
-        memset(buffer, 0, sizeof(buffer));
-        int valread = read(this->connectionMetadata_->get(), buffer, sizeof(buffer));
+        int valread = read(this->fd_, buffer, sizeof(buffer));
+        if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (valread < 0 && errno == EINTR)
+            continue;
         if (valread <= 0)
         {
             this->yeet_flag = true;
-            break;
+            return;
         }
 
-        HttpParsed http = HttpParsed(buffer);
-        if (!is_upgrade_request(http))
-            continue;
-
-        // upgrade
-        std::string websocketKey = http.headers["Sec-WebSocket-Key"];
-        std::string websocketAcceptKey = computeWebsocketAcceptKey(websocketKey);
-
-        std::string response = buildUpgradeResponse(websocketAcceptKey);
+        // Requests may arrive in pieces; handle each once its head is complete.
+        this->request_.append(buffer, valread);
+        size_t end;
+        while (this->yeet_flag == false && (end = this->request_.find("\r\n\r\n")) != std::string::npos)
+        {
+            std::string request = this->request_.substr(0, end + 4);
+            this->request_.erase(0, end + 4);
+            this->handle_request(&request[0]);
+        }
 
-        int bytesSent = send(this->connectionMetadata_->get(), response.c_str(), response.length(), 0);
-        if (bytesSent == -1)
+        if (this->request_.size() > sizeof(buffer) * 4)
         {
-            std::cerr << "Failed to send response: " << strerror(errno) << '\n';
+            std::cerr << "HTTP request head too large\n";
             this->yeet_flag = true;
-            break;
         }
-
-        std::shared_ptr<WebsocketServerThread> websocketServerThread = std::make_shared<WebsocketServerThread>(std::move(this->connectionMetadata_), this->server_, this->queue_);
-        this->server_.lock()->upgrade(std::move(websocketServerThread));
-        break;
     }
+}
 
+void ServerThread::handle_request(char *request)
+{
+    HttpParsed http = HttpParsed(request);
+    if (!is_upgrade_request(http))
+        return;
+
+    // Upgraded or refused, this handler is done with the socket either way.
     this->yeet_flag = true;
+
+    std::shared_ptr<Station> station = select_station(http);
+    if (station == nullptr)
+    {
+        std::string response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        send(this->connectionMetadata_->get(), response.c_str(), response.length(), 0);
+        return;
+    }
+
+    // upgrade
+    std::string websocketKey = http.headers["Sec-WebSocket-Key"];
+    std::string websocketAcceptKey = computeWebsocketAcceptKey(websocketKey);
+
+    std::string protocol = select_protocol(http);
+    std::string extensions = select_extensions(http);
+    std::string response = buildUpgradeResponse(websocketAcceptKey, protocol, extensions);
+
+    int bytesSent = send(this->connectionMetadata_->get(), response.c_str(), response.length(), 0);
+    if (bytesSent == -1)
+    {
+        std::cerr << "Failed to send response: " << strerror(errno) << '\n';
+        return;
+    }
+
+    std::shared_ptr<WebsocketServerThread> websocketServerThread = std::make_shared<WebsocketServerThread>(std::move(this->connectionMetadata_), this->server_, station, this->reactor_, this->listener_options_, protocol == WEBSOCKET_BINARY_AUDIO_PROTOCOL, !extensions.empty());
+    this->reactor_->adopt(websocketServerThread);
+    this->server_.lock()->upgrade(websocketServerThread, station);
+
+    // Whatever followed the request head already belongs to the WebSocket,
+    // and the socket is edge-triggered: anything else already waiting
+    // would not raise another edge, so the new handler reads to EAGAIN.
+    websocketServerThread->receive(this->request_.data(), this->request_.size());
+    this->request_.clear();
+    websocketServerThread->on_readable();
 }
 
 #endif // !SERVER_THREAD_H
\ No newline at end of file
@@ -8,10 +8,14 @@ public:
     virtual bool yeet() = 0;
 };
 
+// A connection as served by a Reactor. The socket is non-blocking and
+// edge-triggered: on_readable() must read until EAGAIN.
 class BaseServerThread : public Object
 {
 public:
-    virtual void start_handling() = 0;
+    virtual int fd() = 0;
+    virtual void on_readable() = 0;
+    virtual void on_writable() {}
     virtual bool yeet() = 0;
     virtual ~BaseServerThread() {}
 };
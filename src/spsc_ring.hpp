@@ -0,0 +1,45 @@
+#pragma once
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Bounded single-producer single-consumer queue. One thread may push and
+// one other thread may pop at the same time without locks; neither blocks.
+template <typename T, size_t Capacity>
+class SpscRing
+{
+public:
+    // False when full; value is left untouched then.
+    bool push(T &value)
+    {
+        size_t tail = this->tail_.load(std::memory_order_relaxed);
+        if (tail - this->head_.load(std::memory_order_acquire) == Capacity)
+            return false;
+
+        this->slots_[tail % Capacity] = std::move(value);
+        this->tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &value)
+    {
+        size_t head = this->head_.load(std::memory_order_relaxed);
+        if (head == this->tail_.load(std::memory_order_acquire))
+            return false;
+
+        value = std::move(this->slots_[head % Capacity]);
+        this->slots_[head % Capacity] = T();
+        this->head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T slots_[Capacity];
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+#endif // !SPSC_RING_H
@@ -6,11 +6,13 @@
 #include <memory>
 
 class WebsocketServerThread;
+class Station;
 
 class BaseWebsocketServer
 {
 public:
-    virtual void upgrade(std::shared_ptr<WebsocketServerThread> serverThread) = 0;
+    // Subscribes the upgraded connection to the station's queue.
+    virtual void upgrade(std::shared_ptr<WebsocketServerThread> serverThread, std::shared_ptr<Station> station) = 0;
 };
 
 #endif // !WEBSOCKET_SERVER_INTERFACE_H
\ No newline at end of file
@@ -7,6 +7,10 @@
 #include "websocket_server_interface.hpp"
 #include "server_thread.hpp"
 #include "server.hpp"
+#include "reactor.hpp"
+#include "send_path.hpp"
+#include "broadcast_shard.hpp"
+#include "permessage_deflate.hpp"
 
 // standard
 #include <unistd.h>
@@ -15,7 +19,16 @@
 #include <vector>
 #include <nlohmann/json.hpp>
 #include <memory>
-#include <thread>
+#include <deque>
+#include <atomic>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WEBSOCKET_UNMASK_X86
+#endif
 
 enum class WebsocketOpcode
 {
@@ -27,431 +40,279 @@ enum class WebsocketOpcode
     PONG = 0xA
 };
 
-enum class WebsocketFrameLengthStage
-{
-    LENGTH_7_BIT,
-    LENGTH_16_BIT,
-    LENGTH_64_BIT
-};
+// Bytes asked of each read() from a client.
+#define WEBSOCKET_READ_CHUNK 16384
+// Largest frame, or fragmented message once reassembled, a client may send.
+#define WEBSOCKET_MAX_MESSAGE (1024 * 1024)
 
-enum class WebsocketFrameProcessingState
+// XORs a frame payload with its 4 byte masking key, in place. The key
+// repeats from the first payload byte, so every 16 or 32 byte vector lines
+// up with it.
+static void websocket_unmask_scalar(char *data, size_t size, const unsigned char *mask)
 {
-    PROCESSING_START,
-    OPCODE_PROCESSED,
-    MASK_FLAG_PROCESSED,
-    LENGTH_PROCESSED,
-    MASKING_KEY_PROCESSED,
-    FINISHED_PROCESSING
-};
+    for (size_t i = 0; i < size; i++)
+        data[i] ^= mask[i % 4];
+}
 
-class WSStage
-{
-public:
-    virtual WebsocketFrameProcessingState push_data(char byte) = 0;
-    virtual void update_state(WebsocketFrameProcessingState state) = 0;
-};
+#ifdef WEBSOCKET_UNMASK_X86
 
-class WSFinOpcode : public WSStage
+__attribute__((target("sse2"))) static void websocket_unmask_sse2(char *data, size_t size, const unsigned char *mask)
 {
-public:
-    WSFinOpcode(){};
+    int key;
+    memcpy(&key, mask, sizeof(key));
+    __m128i keys = _mm_set1_epi32(key);
 
-    WebsocketFrameProcessingState push_data(char byte) override
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
     {
-        switch (this->state_)
-        {
-        case WebsocketFrameProcessingState::PROCESSING_START:
-            this->byte_ = byte;
-            this->state_ = WebsocketFrameProcessingState::OPCODE_PROCESSED;
-            break;
-        default:
-            break;
-        }
-
-        return this->state_;
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(bytes, keys));
     }
+    websocket_unmask_scalar(data + i, size - i, mask);
+}
 
-    void update_state(WebsocketFrameProcessingState state) override
-    {
-        this->state_ = state;
-    }
+__attribute__((target("avx2"))) static void websocket_unmask_avx2(char *data, size_t size, const unsigned char *mask)
+{
+    int key;
+    memcpy(&key, mask, sizeof(key));
+    __m256i keys = _mm256_set1_epi32(key);
 
-    bool fin()
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
     {
-        return (this->byte_ >> 7) & 0x1;
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(bytes, keys));
     }
+    websocket_unmask_sse2(data + i, size - i, mask);
+}
 
-    WebsocketOpcode opcode()
-    {
-        return (WebsocketOpcode)(this->byte_ & 0xF);
-    }
+#endif
 
-    char rsv()
-    {
-        return (this->byte_ >> 4) & 0x7;
-    }
+inline void websocket_unmask(char *data, size_t size, const unsigned char *mask)
+{
+    typedef void (*Kernel)(char *, size_t, const unsigned char *);
+    static const Kernel kernel = []() -> Kernel
+    {
+#ifdef WEBSOCKET_UNMASK_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return websocket_unmask_avx2;
+        if (__builtin_cpu_supports("sse2"))
+            return websocket_unmask_sse2;
+#endif
+        return websocket_unmask_scalar;
+    }();
+    kernel(data, size, mask);
+}
 
-private:
-    WebsocketFrameProcessingState state_ = WebsocketFrameProcessingState::PROCESSING_START;
-    char byte_;
+struct WebsocketFrameHeader
+{
+    bool fin;
+    // RSV1 marks the first frame of a permessage-deflate message.
+    bool rsv1;
+    WebsocketOpcode opcode;
+    bool masked;
+    unsigned long long length;
+    unsigned char mask[4];
 };
 
-class WSMaskLength : public WSStage
+// Decodes the frame header at the start of data. Returns its size, or 0
+// while fewer than the whole header has arrived.
+inline size_t parse_websocket_frame_header(const char *data, size_t size, WebsocketFrameHeader &header)
 {
-public:
-    WSMaskLength(){};
+    if (size < 2)
+        return 0;
 
-    WebsocketFrameProcessingState push_data(char byte) override
-    {
-        switch (this->state_)
-        {
-        case WebsocketFrameProcessingState::OPCODE_PROCESSED:
-            this->masked_ = (byte >> 7) & 0x1;
-            this->length_ = byte & 0x7F;
-            this->state_ = WebsocketFrameProcessingState::MASK_FLAG_PROCESSED;
-
-            if (this->length_ < 126)
-                this->state_ = WebsocketFrameProcessingState::LENGTH_PROCESSED;
-            else if (this->length_ == 126)
-            {
-                this->length_stage_ = WebsocketFrameLengthStage::LENGTH_16_BIT;
-                this->length_buffer_.reserve(2);
-            }
-            else if (this->length_ == 127)
-            {
-                this->length_stage_ = WebsocketFrameLengthStage::LENGTH_64_BIT;
-                this->length_buffer_.reserve(8);
-            }
-            break;
-        case WebsocketFrameProcessingState::MASK_FLAG_PROCESSED:
-            if (this->state_ == WebsocketFrameProcessingState::LENGTH_PROCESSED)
-                break;
+    const unsigned char *bytes = (const unsigned char *)data;
+    header.fin = bytes[0] & 0x80;
+    header.rsv1 = bytes[0] & 0x40;
+    header.opcode = (WebsocketOpcode)(bytes[0] & 0x0F);
+    header.masked = bytes[1] & 0x80;
+    header.length = bytes[1] & 0x7F;
 
-            this->length_buffer_.push_back(byte);
-            if (this->length_buffer_.size() == 2 && this->length_stage_ == WebsocketFrameLengthStage::LENGTH_16_BIT)
-            {
-                this->length_ = (this->length_buffer_[0] << 8) + this->length_buffer_[1];
-                this->state_ = WebsocketFrameProcessingState::LENGTH_PROCESSED;
-            }
-            else if (this->length_buffer_.size() == 8 && this->length_stage_ == WebsocketFrameLengthStage::LENGTH_64_BIT)
-            {
-                this->length_ = (this->length_buffer_[0] << 56) + (this->length_buffer_[1] << 48) + (this->length_buffer_[2] << 40) + (this->length_buffer_[3] << 32) + (this->length_buffer_[4] << 24) + (this->length_buffer_[5] << 16) + (this->length_buffer_[6] << 8) + this->length_buffer_[7];
-                this->state_ = WebsocketFrameProcessingState::LENGTH_PROCESSED;
-            }
-            break;
-        default:
-            break;
-        }
-        return this->state_;
-    }
-
-    void update_state(WebsocketFrameProcessingState state) override
-    {
-        this->state_ = state;
-    }
+    size_t offset = 2;
+    size_t extended = header.length == 126 ? 2 : header.length == 127 ? 8 : 0;
+    if (size < offset + extended + (header.masked ? 4 : 0))
+        return 0;
 
-    unsigned long long length()
+    if (extended > 0)
     {
-        return this->length_;
+        header.length = 0;
+        for (size_t i = 0; i < extended; i++)
+            header.length = (header.length << 8) | bytes[offset + i];
+        offset += extended;
     }
 
-    bool masked()
+    if (header.masked)
     {
-        return this->masked_;
+        memcpy(header.mask, bytes + offset, 4);
+        offset += 4;
     }
+    return offset;
+}
 
-private:
-    WebsocketFrameProcessingState state_ = WebsocketFrameProcessingState::PROCESSING_START;
-    WebsocketFrameLengthStage length_stage_ = WebsocketFrameLengthStage::LENGTH_7_BIT;
-    unsigned long long length_;
-    bool masked_;
-
-    std::vector<char> length_buffer_;
+// A received message. data points into the connection's buffers and stays
+// valid until the next WebsocketBuffer::prepare().
+struct WebsocketMessage
+{
+    WebsocketOpcode opcode;
+    const char *data;
+    size_t size;
 };
 
-class WSMaskingKey : public WSStage
+// Per-connection receive buffer and frame parser. read() goes straight into
+// it; frames are decoded and unmasked where they landed and unfragmented
+// messages are handed out without a copy. Only fragmented or compressed
+// messages are assembled elsewhere.
+class WebsocketBuffer
 {
 public:
-    WSMaskingKey()
-    {
-        this->buffer_.reserve(4);
-    };
+    WebsocketBuffer() {}
 
-    WebsocketFrameProcessingState push_data(char byte) override
-    {
-        switch (this->state_)
-        {
-        case WebsocketFrameProcessingState::LENGTH_PROCESSED:
-            this->buffer_.push_back(byte);
-            if (this->buffer_.size() == 4)
-                this->state_ = WebsocketFrameProcessingState::MASKING_KEY_PROCESSED;
-            break;
-        default:
-            break;
-        }
+    // Accept messages compressed with the negotiated permessage-deflate.
+    void enable_deflate() { this->deflate_ = true; }
 
-        return this->state_;
-    }
+    // Room for at least WEBSOCKET_READ_CHUNK bytes at the end of the
+    // buffer; commit() then keeps the first size of them.
+    char *prepare(size_t &available);
+    void commit(size_t size) { this->end_ += size; }
 
-    void update_state(WebsocketFrameProcessingState state) override
-    {
-        this->state_ = state;
-    }
+    // The next complete message, or false when more data is needed. Any
+    // number of frames may be waiting from one read().
+    bool next(WebsocketMessage &message);
 
-    std::vector<char> masking_key()
-    {
-        return this->buffer_;
-    }
+    // The client broke the protocol; the connection should be closed.
+    bool failed() { return this->failed_; }
 
 private:
-    WebsocketFrameProcessingState state_ = WebsocketFrameProcessingState::PROCESSING_START;
     std::vector<char> buffer_;
-};
-
-class WebsocketFrameRaw
-{
-public:
-    WebsocketFrameRaw(){};
-
-    WebsocketFrameProcessingState push_data(char *buffer, int buffer_size)
-    {
-        for (int i = 0; i < buffer_size; i++)
-        {
-            if (this->state_ == WebsocketFrameProcessingState::PROCESSING_START)
-            {
-                this->state_ = this->fin_opcode_stage_.push_data(buffer[i]);
-                // update states
-                this->mask_length_stage_.update_state(this->state_);
-                this->masking_key_stage_.update_state(this->state_);
-            }
-            else if (this->state_ == WebsocketFrameProcessingState::OPCODE_PROCESSED)
-            {
-                WebsocketFrameProcessingState next = this->mask_length_stage_.push_data(buffer[i]);
-
-                if (next == WebsocketFrameProcessingState::LENGTH_PROCESSED)
-                    this->payload_.reserve(this->mask_length_stage_.length());
-                this->state_ = next;
-
-                // update states
-                this->masking_key_stage_.update_state(this->state_);
-            }
-            else if (this->state_ == WebsocketFrameProcessingState::MASK_FLAG_PROCESSED)
-            {
-                WebsocketFrameProcessingState next = this->mask_length_stage_.push_data(buffer[i]);
-
-                if (next == WebsocketFrameProcessingState::LENGTH_PROCESSED)
-                    this->payload_.reserve(this->mask_length_stage_.length());
-                this->state_ = next;
-
-                // update states
-                this->masking_key_stage_.update_state(this->state_);
-            }
-            else if (this->state_ == WebsocketFrameProcessingState::LENGTH_PROCESSED)
-            {
-                if (this->mask_length_stage_.masked())
-                {
-                    this->state_ = this->masking_key_stage_.push_data(buffer[i]);
-                }
-                else
-                {
-                    this->state_ = WebsocketFrameProcessingState::MASKING_KEY_PROCESSED;
-                    int bytes_left = buffer_size - i;
-                    int bytes_to_copy = std::min(bytes_left, (int)this->mask_length_stage_.length() - (int)this->payload_.size());
-                    this->payload_.insert(this->payload_.end(), buffer + i, buffer + i + bytes_to_copy);
-
-                    if (this->payload_.size() == this->mask_length_stage_.length())
-                    {
-                        this->unmask_payload();
-                        this->state_ = WebsocketFrameProcessingState::FINISHED_PROCESSING;
-                    }
-                }
-
-                // update states
-                this->masking_key_stage_.update_state(this->state_);
-            }
-            else if (this->state_ == WebsocketFrameProcessingState::MASKING_KEY_PROCESSED)
-            {
-                int bytes_left = buffer_size - i;
-                int bytes_to_copy = std::min(bytes_left, (int)this->mask_length_stage_.length() - (int)this->payload_.size());
-                this->payload_.insert(this->payload_.end(), buffer + i, buffer + i + bytes_to_copy);
-
-                if (this->payload_.size() == this->mask_length_stage_.length())
-                {
-                    this->unmask_payload();
-                    this->state_ = WebsocketFrameProcessingState::FINISHED_PROCESSING;
-                    break;
-                }
-            }
-        }
-
-        return this->state_;
-    }
-
-    bool finished_processing()
-    {
-        return this->state_ == WebsocketFrameProcessingState::FINISHED_PROCESSING;
-    }
-
-    bool fin()
-    {
-        return this->fin_opcode_stage_.fin();
-    }
+    // Unparsed bytes are buffer_[begin_, end_).
+    size_t begin_ = 0;
+    size_t end_ = 0;
 
-    std::vector<bool> reserved()
-    {
-        std::vector<bool> reserved;
-        reserved.push_back((this->fin_opcode_stage_.rsv() >> 2) & 0x1);
-        reserved.push_back((this->fin_opcode_stage_.rsv() >> 1) & 0x1);
-        reserved.push_back(this->fin_opcode_stage_.rsv() & 0x1);
-        return reserved;
-    }
-    WebsocketOpcode opcode()
-    {
-        return this->fin_opcode_stage_.opcode();
-    }
-    bool is_masked()
-    {
-        return this->mask_length_stage_.masked();
-    }
-    unsigned long long payload_length()
-    {
-        return this->mask_length_stage_.length();
-    }
-    std::vector<char> masking_key()
-    {
-        return this->masking_key_stage_.masking_key();
-    }
-    WebsocketFrameProcessingState state()
-    {
-        return this->state_;
-    }
-    std::vector<char> payload_;
+    // A fragmented message being reassembled.
+    bool fragmented_ = false;
+    bool fragments_compressed_ = false;
+    WebsocketOpcode fragments_opcode_ = WebsocketOpcode::TEXT;
+    std::vector<char> fragments_;
 
-private:
-    WebsocketFrameProcessingState state_ = WebsocketFrameProcessingState::PROCESSING_START;
-    WSFinOpcode fin_opcode_stage_;
-    WSMaskLength mask_length_stage_;
-    WSMaskingKey masking_key_stage_;
-    void unmask_payload()
-    {
-        if (!this->mask_length_stage_.masked())
-            return;
+    std::vector<char> inflated_;
+    bool deflate_ = false;
+    bool failed_ = false;
 
-        std::vector<char> mask = this->masking_key_stage_.masking_key();
-        for (int i = 0; i < this->payload_.size(); i++)
-            this->payload_[i] = this->payload_[i] ^ mask[i % 4];
-    };
+    bool complete(WebsocketOpcode opcode, bool compressed, const char *data, size_t size, WebsocketMessage &message);
 };
 
-class WebsocketFrame
+char *WebsocketBuffer::prepare(size_t &available)
 {
-public:
-    WebsocketFrame(WebsocketFrameRaw &&raw) : raw_(std::move(raw)) {}
-
-    bool fin()
+    if (this->begin_ == this->end_)
     {
-        return this->raw_.fin();
+        this->begin_ = this->end_ = 0;
+        // Give back what one large message grew the buffer to.
+        if (this->buffer_.size() > 4 * WEBSOCKET_READ_CHUNK)
+            std::vector<char>().swap(this->buffer_);
     }
-
-    std::vector<bool> reserved()
+    else if (this->begin_ > 0 && this->buffer_.size() - this->end_ < WEBSOCKET_READ_CHUNK)
     {
-        return this->raw_.reserved();
+        memmove(this->buffer_.data(), this->buffer_.data() + this->begin_, this->end_ - this->begin_);
+        this->end_ -= this->begin_;
+        this->begin_ = 0;
     }
 
-    WebsocketOpcode opcode()
-    {
-        return this->raw_.opcode();
-    }
-
-    bool is_masked()
-    {
-        return this->raw_.is_masked();
-    }
+    if (this->buffer_.size() - this->end_ < WEBSOCKET_READ_CHUNK)
+        this->buffer_.resize(this->end_ + WEBSOCKET_READ_CHUNK);
 
-    unsigned long long payload_length()
-    {
-        return this->raw_.payload_length();
-    }
-
-    auto getMoveIterators()
-    {
-        return std::make_pair(std::make_move_iterator(this->raw_.payload_.begin()), std::make_move_iterator(this->raw_.payload_.end()));
-    }
-
-    void clear()
-    {
-        this->raw_.payload_.clear();
-    }
-
-private:
-    WebsocketFrameRaw raw_;
-};
+    available = this->buffer_.size() - this->end_;
+    return this->buffer_.data() + this->end_;
+}
 
-class WebsocketBuffer
+bool WebsocketBuffer::next(WebsocketMessage &message)
 {
-public:
-    WebsocketBuffer(){};
-
-    void push_data(char *buffer, int buffer_size)
-    {
-        WebsocketFrameProcessingState state = this->raw_.push_data(buffer, buffer_size);
-        if (state == WebsocketFrameProcessingState::FINISHED_PROCESSING)
+    while (!this->failed_)
+    {
+        WebsocketFrameHeader header;
+        size_t header_size = parse_websocket_frame_header(this->buffer_.data() + this->begin_, this->end_ - this->begin_, header);
+        if (header_size == 0)
+            return false;
+
+        // Clients must mask every frame. Control frames are never fragmented,
+        // carry at most 125 bytes, and like continuations never set RSV1,
+        // which only marks the first frame of a compressed message.
+        bool control = (int)header.opcode & 0x8;
+        if (!header.masked || header.length > WEBSOCKET_MAX_MESSAGE ||
+            (control && (!header.fin || header.length > 125)) ||
+            ((control || header.opcode == WebsocketOpcode::CONTINUATION) && header.rsv1))
         {
-            this->frames_.push_back(WebsocketFrame(std::move(this->raw_)));
-            this->raw_ = WebsocketFrameRaw();
+            this->failed_ = true;
+            return false;
         }
-    }
+        if (this->end_ - this->begin_ < header_size + header.length)
+            return false;
 
-    std::unique_ptr<std::pair<WebsocketOpcode, std::vector<char>>> get_payload()
-    {
-        if (this->frames_.size() == 0)
-            return nullptr;
-        std::vector<char> payload = std::vector<char>();
+        char *payload = this->buffer_.data() + this->begin_ + header_size;
+        size_t size = header.length;
+        this->begin_ += header_size + size;
+        websocket_unmask(payload, size, header.mask);
 
-        WebsocketOpcode opcode = this->frames_[0].opcode();
+        // Control frames may arrive between the fragments of a message.
+        if (control)
+        {
+            message = WebsocketMessage{header.opcode, payload, size};
+            return true;
+        }
 
-        // Check if fin frame exists
-        bool finished_frame_exists = false;
-        for (auto frame = this->frames_.begin(); frame != this->frames_.end(); frame++)
+        if (header.opcode != WebsocketOpcode::CONTINUATION)
         {
-            if (frame->fin())
-            {
-                finished_frame_exists = true;
+            if (this->fragmented_)
                 break;
-            }
-        }
+            if (header.fin)
+                return this->complete(header.opcode, header.rsv1, payload, size, message);
 
-        if (!finished_frame_exists)
-            return nullptr;
+            this->fragmented_ = true;
+            this->fragments_compressed_ = header.rsv1;
+            this->fragments_opcode_ = header.opcode;
+            this->fragments_.assign(payload, payload + size);
+            continue;
+        }
 
-        if (opcode == WebsocketOpcode::CONTINUATION)
-            throw std::runtime_error("First frame should not be continuation");
+        if (!this->fragmented_ || this->fragments_.size() + size > WEBSOCKET_MAX_MESSAGE)
+            break;
+        this->fragments_.insert(this->fragments_.end(), payload, payload + size);
+        if (!header.fin)
+            continue;
 
-        for (auto frame = this->frames_.begin(); frame != this->frames_.end(); frame++)
-        {
-            auto iterators = frame->getMoveIterators();
-            payload.insert(payload.end(), iterators.first, iterators.second);
+        this->fragmented_ = false;
+        return this->complete(this->fragments_opcode_, this->fragments_compressed_, this->fragments_.data(), this->fragments_.size(), message);
+    }
 
-            if (frame->fin())
-            {
-                this->frames_.erase(this->frames_.begin(), frame + 1);
-                break;
-            }
-        }
+    this->failed_ = true;
+    return false;
+}
 
-        return std::make_unique<std::pair<WebsocketOpcode, std::vector<char>>>(opcode, std::move(payload));
+bool WebsocketBuffer::complete(WebsocketOpcode opcode, bool compressed, const char *data, size_t size, WebsocketMessage &message)
+{
+    if (!compressed)
+    {
+        message = WebsocketMessage{opcode, data, size};
+        return true;
     }
 
-private:
-    WebsocketFrameRaw raw_;
-    std::vector<WebsocketFrame> frames_;
-};
+    // RSV1 without the extension, or a corrupt message, is a protocol error.
+    if (!this->deflate_ || !inflate_message(data, size, this->inflated_))
+    {
+        this->failed_ = true;
+        return false;
+    }
+    message = WebsocketMessage{opcode, this->inflated_.data(), this->inflated_.size()};
+    return true;
+}
 
-std::unique_ptr<std::vector<char>> get_websocket_frame_buffer(WebsocketOpcode opcode, std::string payload, bool fin = true)
+// compressed sets RSV1, for the first frame of a permessage-deflate message.
+std::unique_ptr<std::vector<char>> get_websocket_frame_buffer(WebsocketOpcode opcode, std::string payload, bool fin = true, bool compressed = false)
 {
     std::unique_ptr<std::vector<char>> buffer = std::make_unique<std::vector<char>>();
 
-    buffer->push_back((fin << 7) + ((char)opcode & 0xF));
+    buffer->push_back((fin << 7) + (compressed << 6) + ((char)opcode & 0xF));
 
     unsigned long long payload_length = payload.size();
 
@@ -483,109 +344,588 @@ std::unique_ptr<std::vector<char>> get_websocket_frame_buffer(WebsocketOpcode op
 
     return buffer;
 }
+
+// A whole data message in one frame, compressed when deflate was negotiated
+// and the payload is worth it.
+std::unique_ptr<std::vector<char>> get_websocket_message_buffer(WebsocketOpcode opcode, const std::string &payload, bool deflate)
+{
+    std::string compressed;
+    if (deflate && payload.size() >= WEBSOCKET_DEFLATE_MIN_SIZE && deflate_message(payload, compressed))
+        return get_websocket_frame_buffer(opcode, std::move(compressed), true, true);
+    return get_websocket_frame_buffer(opcode, payload, true);
+}
+// Subprotocol a client offers in Sec-WebSocket-Protocol to receive audio
+// as BINARY frames instead of JSON with base64. Control and queue messages
+// stay JSON either way.
+#define WEBSOCKET_BINARY_AUDIO_PROTOCOL "sk2-radio.binary.v1"
+
+// Binary audio frame payload: a fixed header followed by the raw block data.
+// All fields are big-endian.
+//   0  u8   version
+//   1  u8   codec (0 pcm, 1 mp3, 2 opus)
+//   2  u8   channels
+//   3  u8   header size
+//   4  u32  sequence number
+//   8  u64  timestamp, microseconds of stream time
+//  16  u32  sampling rate
+//  20  u32  duration, microseconds
+//  24  u16  mpg123 encoding (pcm only)
+//  26  u16  reserved
+#define AUDIO_BINARY_HEADER_VERSION 1
+#define AUDIO_BINARY_HEADER_SIZE 28
+
+// Slots in AudioBroadcast's frame cache, one per wire format.
+enum AudioFrameVariant : size_t
+{
+    AUDIO_FRAME_TEXT_JSON = 0,
+    AUDIO_FRAME_BINARY = 1,
+    AUDIO_FRAME_TEXT_JSON_DEFLATE = 2
+};
+
+// Slots in QueueUpdate's frame cache.
+enum QueueFrameVariant : size_t
+{
+    QUEUE_FRAME_TEXT = 0,
+    QUEUE_FRAME_DEFLATE = 1
+};
+
+static void put_big_endian(std::string &buffer, size_t offset, unsigned long long value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; i++)
+        buffer[offset + i] = (value >> (8 * (bytes - 1 - i))) & 0xFF;
+}
+
+std::string get_binary_audio_payload(const AudioBroadcast &broadcast)
+{
+    const std::shared_ptr<AudioBlock> &block = broadcast.block;
+    std::string payload(AUDIO_BINARY_HEADER_SIZE, '\0');
+
+    put_big_endian(payload, 0, AUDIO_BINARY_HEADER_VERSION, 1);
+    put_big_endian(payload, 1, (unsigned long long)block->codec, 1);
+    put_big_endian(payload, 2, block->channels, 1);
+    put_big_endian(payload, 3, AUDIO_BINARY_HEADER_SIZE, 1);
+    put_big_endian(payload, 4, broadcast.sequence, 4);
+    put_big_endian(payload, 8, (unsigned long long)(broadcast.timestamp * 1000000), 8);
+    put_big_endian(payload, 16, block->sampling_rate, 4);
+    put_big_endian(payload, 20, (unsigned long long)(block->duration * 1000000), 4);
+    put_big_endian(payload, 24, block->encoding, 2);
+
+    payload.append((const char *)block->data, block->size);
+    return payload;
+}
+
+// What to do with a listener whose socket cannot keep up with the stream.
+enum class SlowConsumerPolicy
+{
+    // Throw away its oldest queued audio, so it hears gaps.
+    DROP_OLDEST,
+    // Throw away all its queued audio and carry on from the newest block.
+    SKIP_TO_LIVE,
+    // Close the connection.
+    DISCONNECT
+};
+
+#define LISTENER_DEFAULT_MAX_LAG 5.0
+#define LISTENER_DEFAULT_MAX_QUEUED_BYTES (8 * 1024 * 1024)
+
+struct ListenerOptions
+{
+    SlowConsumerPolicy policy = SlowConsumerPolicy::DROP_OLDEST;
+    // Seconds of audio a listener may have queued before the policy applies.
+    double max_lag = LISTENER_DEFAULT_MAX_LAG;
+    // Past this many queued bytes of any kind the listener is disconnected.
+    size_t max_queued_bytes = LISTENER_DEFAULT_MAX_QUEUED_BYTES;
+};
+
+// Process-wide totals of what the slow consumer policy did.
+struct ListenerCounters
+{
+    inline static std::atomic<unsigned long long> frames_dropped{0};
+    inline static std::atomic<unsigned long long> skips_to_live{0};
+    inline static std::atomic<unsigned long long> disconnects{0};
+};
+
+// One WebSocket client. The playback side only ever queues frames here;
+// the socket is written by the owning reactor when it is writable, so a
+// stalled peer costs the clock thread nothing.
 class WebsocketServerThread : public BaseServerThread,
-                              public IAudioListener
+                              public IAudioListener,
+                              public ISendTarget,
+                              public std::enable_shared_from_this<WebsocketServerThread>
 {
 public:
-    WebsocketServerThread(std::unique_ptr<ClientConnectionMetadata> connectionMetadata, std::weak_ptr<BaseWebsocketServer> server, std::weak_ptr<AudioQueueRwLock> queue) : connectionMetadata_(std::move(connectionMetadata)), server_(server), queue_(queue)
+    WebsocketServerThread(std::unique_ptr<ClientConnectionMetadata> connectionMetadata, std::weak_ptr<BaseWebsocketServer> server, std::weak_ptr<Station> queue, Reactor *reactor, ListenerOptions options, bool binary_audio = false, bool deflate = false) : connectionMetadata_(std::move(connectionMetadata)), server_(server), queue_(queue), reactor_(reactor), options_(options), binary_audio_(binary_audio), deflate_(deflate)
     {
-        std::thread thread(&WebsocketServerThread::start_handling, this);
-        thread.detach();
+        std::cout << "Upgraded to websocket" << std::endl;
+
+        if (deflate)
+            this->buffer_.enable_deflate();
+
+        int one = 1;
+        if (reactor->send_path().kind() == SendPathKind::ZEROCOPY)
+            this->zerocopy_ = setsockopt(this->fd(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
     }
-    void start_handling() override;
+    int fd() override { return this->connectionMetadata_->get(); }
+    Reactor *reactor() { return this->reactor_; }
+    void on_readable() override;
+    void on_writable() override;
+    // Handles bytes read from the socket before this handler owned it,
+    // e.g. a frame sent right behind the upgrade request.
+    void receive(const char *data, size_t size);
     bool yeet() override { return yeet_flag; }
 
-    void on_audio_block(std::shared_ptr<AudioBlock> block) override;
+    void on_audio_block(std::shared_ptr<AudioBroadcast> broadcast) override;
+
+    void on_queue_change(std::shared_ptr<QueueUpdate> update) override;
 
-    void on_queue_change(nlohmann::json queue) override;
+    void on_send_complete(ssize_t result) override;
 
     ~WebsocketServerThread() override
     {
-        std::cout << "WebsocketServerThread destructor called" << std::endl;
+        std::cout << "WebsocketServerThread destructor called, sent " << this->audio_blocks_sent_ << " audio blocks, " << this->audio_bytes_sent_ << " bytes in total, dropped " << this->frames_dropped_ << " frames" << std::endl;
     }
 
 private:
-    bool yeet_flag = false;
+    std::atomic<bool> yeet_flag{false};
     std::unique_ptr<ClientConnectionMetadata> connectionMetadata_;
     std::weak_ptr<BaseWebsocketServer> server_;
-    std::weak_ptr<AudioQueueRwLock> queue_;
+    std::weak_ptr<Station> queue_;
+    Reactor *reactor_;
+    ListenerOptions options_;
     WebsocketBuffer buffer_;
+    bool binary_audio_;
+    // permessage-deflate was negotiated; binary audio is sent as is since
+    // it barely compresses.
+    bool deflate_;
+    unsigned long long audio_bytes_sent_ = 0;
+    unsigned long long audio_blocks_sent_ = 0;
+    unsigned long long frames_dropped_ = 0;
+    unsigned long long skips_to_live_ = 0;
+    // Sequence of the newest block queued, so a block that reaches us both
+    // in the join burst and from the shard is only sent once.
+    bool audio_started_ = false;
+    uint64_t last_sequence_ = 0;
+    // Queue version the client is at; deltas are only sent once it has
+    // had a snapshot. Snapshots come from the playback thread, deltas from
+    // the shard, hence the mutex.
+    std::mutex queue_mutex_;
+    bool queue_synced_ = false;
+    uint64_t queue_version_ = 0;
+
+    struct OutboxFrame
+    {
+        std::shared_ptr<const std::vector<char>> data;
+        // Seconds of audio in the frame, 0 for control messages.
+        double duration;
+    };
 
-    void process_payload(std::unique_ptr<std::pair<WebsocketOpcode, std::vector<char>>> payload);
+    // Frames not yet (fully) written, bounded by options_; the front one
+    // may be partially written up to outbox_offset_.
+    std::mutex outbox_mutex_;
+    std::deque<OutboxFrame> outbox_;
+    size_t outbox_offset_ = 0;
+    size_t queued_bytes_ = 0;
+    double queued_audio_ = 0;
+
+    // The front frame is on the reactor's io_uring.
+    bool send_in_flight_ = false;
+    // Frames sent with MSG_ZEROCOPY, by the kernel's per-socket send
+    // counter, held until the error queue reports them done.
+    bool zerocopy_ = false;
+    uint32_t zerocopy_next_ = 0;
+    std::deque<std::pair<uint32_t, std::shared_ptr<const std::vector<char>>>> zerocopy_pending_;
+
+    void send_frame(std::shared_ptr<const std::vector<char>> frame, double duration = 0);
+    void apply_slow_consumer_policy();
+    void drop_frame(std::deque<OutboxFrame>::iterator &it);
+    void flush();
+    bool handle_write_error(int error);
+    void complete_write(size_t written);
+    void reap_zerocopy();
+    void process_buffer();
+    void process_payload(const WebsocketMessage &message);
+    void request_snapshot();
 };
 
-void WebsocketServerThread::start_handling()
+void WebsocketServerThread::on_readable()
 {
-    std::cout << "Upgraded to websocket" << std::endl;
-    char buffer[1024] = {0};
+    if (!this->zerocopy_pending_.empty())
+    {
+        std::unique_lock<std::mutex> lock(this->outbox_mutex_);
+        this->reap_zerocopy();
+    }
 
     while (this->yeet_flag == false)
     {
-        memset(buffer, 0, sizeof(buffer));
-
-        int bytes_read = read(this->connectionMetadata_->get(), buffer, sizeof(buffer));
+        size_t available;
+        char *buffer = this->buffer_.prepare(available);
+        int bytes_read = read(this->connectionMetadata_->get(), buffer, available);
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
         if (bytes_read <= 0)
         {
             this->yeet_flag = true;
-            break;
+            return;
         }
 
-        this->buffer_.push_data(buffer, bytes_read);
+        this->buffer_.commit(bytes_read);
+        this->process_buffer();
+    }
+}
 
-        auto payload = this->buffer_.get_payload();
-        if (payload == nullptr)
+void WebsocketServerThread::receive(const char *data, size_t size)
+{
+    while (size > 0 && this->yeet_flag == false)
+    {
+        size_t available;
+        char *buffer = this->buffer_.prepare(available);
+        size_t copied = std::min(available, size);
+        memcpy(buffer, data, copied);
+        this->buffer_.commit(copied);
+        this->process_buffer();
+        data += copied;
+        size -= copied;
+    }
+}
+
+void WebsocketServerThread::process_buffer()
+{
+    // Messages point into the buffer, so all of them are handled before
+    // the next read.
+    WebsocketMessage message;
+    while (this->yeet_flag == false && this->buffer_.next(message))
+        this->process_payload(message);
+
+    if (this->buffer_.failed())
+    {
+        std::cerr << "WebSocket protocol error, closing connection" << std::endl;
+        this->yeet_flag = true;
+    }
+}
+
+void WebsocketServerThread::on_writable()
+{
+    std::unique_lock<std::mutex> lock(this->outbox_mutex_);
+    this->reap_zerocopy();
+    this->flush();
+}
+
+void WebsocketServerThread::send_frame(std::shared_ptr<const std::vector<char>> frame, double duration)
+{
+    if (this->yeet_flag)
+        return;
+
+    bool idle;
+    {
+        std::unique_lock<std::mutex> lock(this->outbox_mutex_);
+        idle = this->outbox_.empty();
+        this->outbox_.push_back(OutboxFrame{frame, duration});
+        this->queued_bytes_ += frame->size();
+        this->queued_audio_ += duration;
+        this->apply_slow_consumer_policy();
+
+        // Already on the thread that owns the socket: write right away.
+        if (idle && this->reactor_->on_reactor_thread())
+        {
+            this->flush();
+            return;
+        }
+    }
+
+    // A non-empty outbox is already waiting for the socket to drain.
+    if (idle || this->yeet_flag)
+        this->reactor_->wake(this->fd());
+}
+
+// Called with outbox_mutex_ held.
+void WebsocketServerThread::apply_slow_consumer_policy()
+{
+    if (this->queued_bytes_ > this->options_.max_queued_bytes)
+    {
+        std::cerr << "Listener exceeded " << this->options_.max_queued_bytes << " queued bytes, disconnecting" << std::endl;
+        ListenerCounters::disconnects++;
+        this->yeet_flag = true;
+        return;
+    }
+
+    if (this->queued_audio_ <= this->options_.max_lag)
+        return;
+
+    if (this->options_.policy == SlowConsumerPolicy::DISCONNECT)
+    {
+        std::cerr << "Listener fell " << this->queued_audio_ << " s behind, disconnecting" << std::endl;
+        ListenerCounters::disconnects++;
+        this->yeet_flag = true;
+        return;
+    }
+
+    if (this->options_.policy == SlowConsumerPolicy::SKIP_TO_LIVE)
+    {
+        this->skips_to_live_++;
+        ListenerCounters::skips_to_live++;
+    }
+
+    // A partially written or in-flight frame has to be finished or the
+    // stream breaks, and the newest block is kept either way.
+    auto it = this->outbox_.begin();
+    if (this->outbox_offset_ > 0 || this->send_in_flight_)
+        ++it;
+    while (it != this->outbox_.end() && it + 1 != this->outbox_.end())
+    {
+        if (it->duration <= 0)
+        {
+            ++it;
             continue;
+        }
+        if (this->options_.policy == SlowConsumerPolicy::DROP_OLDEST && this->queued_audio_ <= this->options_.max_lag)
+            break;
+        this->drop_frame(it);
+    }
+}
+
+void WebsocketServerThread::drop_frame(std::deque<OutboxFrame>::iterator &it)
+{
+    this->queued_bytes_ -= it->data->size();
+    this->queued_audio_ -= it->duration;
+    this->frames_dropped_++;
+    ListenerCounters::frames_dropped++;
+    it = this->outbox_.erase(it);
+}
+
+// Writes queued frames until the socket would block, or hands the front
+// one to the io_uring. Called with outbox_mutex_ held, on the reactor.
+void WebsocketServerThread::flush()
+{
+    while (!this->outbox_.empty() && this->yeet_flag == false && !this->send_in_flight_)
+    {
+        const OutboxFrame &front = this->outbox_.front();
+        const char *data = front.data->data() + this->outbox_offset_;
+        size_t size = front.data->size() - this->outbox_offset_;
+
+        if (this->reactor_->send_path().kind() == SendPathKind::IO_URING)
+        {
+            // With the ring full, try again on the next pass, after the
+            // reactor has submitted what is queued.
+            this->send_in_flight_ = this->reactor_->send_path().queue_send(this->fd(), data, size, this->shared_from_this(), front.data);
+            if (!this->send_in_flight_)
+                this->reactor_->wake(this->fd());
+            return;
+        }
+
+        ssize_t result = this->zerocopy_ ? send(this->fd(), data, size, MSG_ZEROCOPY | MSG_NOSIGNAL)
+                                         : write(this->fd(), data, size);
+        if (result < 0)
+        {
+            if (this->handle_write_error(errno))
+                continue;
+            return;
+        }
+
+        if (this->zerocopy_)
+            this->zerocopy_pending_.emplace_back(this->zerocopy_next_++, front.data);
+        this->complete_write(result);
+    }
+}
 
-        this->process_payload(std::move(payload));
+// Returns whether the write should be retried right away.
+bool WebsocketServerThread::handle_write_error(int error)
+{
+    if (error == EAGAIN || error == EWOULDBLOCK)
+        return false;
+    if (error == EINTR)
+        return true;
+    if (error == ENOBUFS && this->zerocopy_)
+    {
+        // Out of pinned-page budget; this socket goes back to copying. Frames
+        // already sent zero-copy are still released as the kernel reports
+        // them, starting with any it already has.
+        this->zerocopy_ = false;
+        this->reap_zerocopy();
+        return true;
     }
 
+    if (error == EPIPE)
+    {
+        std::cerr << "Broken pipe encountered" << std::endl;
+    }
+    else
+    {
+        std::cerr << "Failed to write to socket: " << strerror(error) << std::endl;
+    }
     this->yeet_flag = true;
+    return false;
 }
 
-void WebsocketServerThread::process_payload(std::unique_ptr<std::pair<WebsocketOpcode, std::vector<char>>> payload)
+void WebsocketServerThread::complete_write(size_t written)
 {
-    if (payload->first == WebsocketOpcode::TEXT)
+    const OutboxFrame &front = this->outbox_.front();
+    this->audio_bytes_sent_ += written;
+    this->outbox_offset_ += written;
+    if (this->outbox_offset_ < front.data->size())
+        return;
+
+    if (front.duration > 0)
+        this->audio_blocks_sent_++;
+    this->queued_bytes_ -= front.data->size();
+    this->queued_audio_ -= front.duration;
+    this->outbox_.pop_front();
+    this->outbox_offset_ = 0;
+}
+
+void WebsocketServerThread::on_send_complete(ssize_t result)
+{
+    std::unique_lock<std::mutex> lock(this->outbox_mutex_);
+    this->send_in_flight_ = false;
+    if (result < 0)
+    {
+        // On EAGAIN the next EPOLLOUT resumes the flush.
+        if (this->handle_write_error(-result))
+            this->flush();
+        else if (this->yeet_flag)
+            this->reactor_->wake(this->fd());
+        return;
+    }
+
+    this->complete_write(result);
+    this->flush();
+}
+
+// Releases frames whose MSG_ZEROCOPY sends the kernel has finished with.
+// TCP reports them in order. Called with outbox_mutex_ held.
+void WebsocketServerThread::reap_zerocopy()
+{
+    while (!this->zerocopy_pending_.empty())
+    {
+        char control[128];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(this->fd(), &message, MSG_ERRQUEUE) < 0)
+            return;
+
+        for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+        {
+            bool recverr = (header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) ||
+                           (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR);
+            if (!recverr)
+                continue;
+
+            struct sock_extended_err *error = (struct sock_extended_err *)CMSG_DATA(header);
+            if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // ee_info..ee_data is the range of sends that completed.
+            while (!this->zerocopy_pending_.empty() && (int32_t)(this->zerocopy_pending_.front().first - error->ee_data) <= 0)
+                this->zerocopy_pending_.pop_front();
+        }
+    }
+}
+
+void WebsocketServerThread::process_payload(const WebsocketMessage &message)
+{
+    if (message.opcode == WebsocketOpcode::TEXT)
     {
-        std::string payload_string(payload->second.begin(), payload->second.end());
         try
         {
-            nlohmann::json json = nlohmann::json::parse(payload_string);
+            nlohmann::json json = nlohmann::json::parse(message.data, message.data + message.size);
             if (json["type"] == "command")
             {
+                // Queue changes are posted to the station's playback thread
+                // and take effect at its next tick.
+                std::shared_ptr<Station> station = this->queue_.lock();
+                if (station == nullptr)
+                    return;
+
                 if (json["command"] == "skip")
                 {
-                    this->queue_.lock()->lock_write();
-                    this->queue_.lock()->get_queue().skip_audio_file(int(json["idx"]));
-                    this->queue_.lock()->unlock_write();
+                    int idx = json["idx"];
+                    station->get_queue().post([idx](AudioQueue &queue)
+                                              { queue.skip_audio_file(idx); });
                 }
 
                 else if (json["command"] == "swap")
                 {
-                    this->queue_.lock()->lock_write();
-                    this->queue_.lock()->get_queue().swap_audio_files(int(json["idx1"]), int(json["idx2"]));
-                    this->queue_.lock()->unlock_write();
+                    int idx1 = json["idx1"];
+                    int idx2 = json["idx2"];
+                    station->get_queue().post([idx1, idx2](AudioQueue &queue)
+                                              { queue.swap_audio_files(idx1, idx2); });
                 }
 
                 else if (json["command"] == "cplay")
                 {
-                    this->queue_.lock()->lock_write();
-                    this->queue_.lock()->get_queue().cplay();
-                    this->queue_.lock()->unlock_write();
+                    station->get_queue().post([](AudioQueue &queue)
+                                              { queue.cplay(); });
                 }
 
                 else if (json["command"] == "get_song")
                 {
-                    std::shared_ptr<AudioFile> file = std::make_shared<AudioFile>("Captain.mp3");
-                    this->queue_.lock()->lock_write();
-                    this->queue_.lock()->get_queue().push(file);
-                    this->queue_.lock()->unlock_write();
+                    station->get_queue().post([](AudioQueue &queue)
+                                              { queue.push(std::make_shared<AudioFile>("Captain.mp3", queue.get_file_options())); });
+                }
+
+                else if (json["command"] == "crossfade")
+                {
+                    double seconds = json["seconds"];
+                    station->get_queue().post([seconds](AudioQueue &queue)
+                                              { queue.set_crossfade(seconds); });
+                }
+
+                else if (json["command"] == "seek")
+                {
+                    double position = json["position"];
+                    station->get_queue().post([position](AudioQueue &queue)
+                                              { queue.seek(position); });
+                }
+
+                else if (json["command"] == "send_ahead")
+                {
+                    double ms = json["ms"];
+                    station->get_queue().post([ms](AudioQueue &queue)
+                                              { queue.set_send_ahead(ms); });
+                }
+
+                else if (json["command"] == "normalize")
+                {
+                    bool enabled = json.value("enabled", true);
+                    double target = json.value("target", LOUDNESS_DEFAULT_TARGET);
+                    station->get_queue().post([enabled, target](AudioQueue &queue)
+                                              { queue.set_normalization(enabled, target); });
+                }
+
+                else if (json["command"] == "stats")
+                {
+                    nlohmann::json stats;
+                    stats["type"] = "stats";
+                    {
+                        std::unique_lock<std::mutex> lock(this->outbox_mutex_);
+                        stats["listener"]["queued_bytes"] = this->queued_bytes_;
+                        stats["listener"]["queued_audio"] = this->queued_audio_;
+                        stats["listener"]["audio_blocks_sent"] = this->audio_blocks_sent_;
+                        stats["listener"]["frames_dropped"] = this->frames_dropped_;
+                        stats["listener"]["skips_to_live"] = this->skips_to_live_;
+                    }
+                    stats["server"]["frames_dropped"] = ListenerCounters::frames_dropped.load();
+                    stats["server"]["skips_to_live"] = ListenerCounters::skips_to_live.load();
+                    stats["server"]["disconnects"] = ListenerCounters::disconnects.load();
+                    stats["server"]["shard_overflows"] = BroadcastShard::overflows();
+                    this->send_frame(get_websocket_message_buffer(WebsocketOpcode::TEXT, stats.dump(), this->deflate_));
+                }
+
+                else if (json["command"] == "resync")
+                {
+                    // The client saw a gap in the queue versions.
+                    std::unique_lock<std::mutex> lock(this->queue_mutex_);
+                    this->queue_synced_ = false;
+                    this->request_snapshot();
                 }
 
                 else if (json["command"] == "rewind")
                 {
-                    this->queue_.lock()->lock_write();
-                    this->queue_.lock()->get_queue().rewind();
-                    this->queue_.lock()->unlock_write();
+                    station->get_queue().post([](AudioQueue &queue)
+                                              { queue.rewind(); });
                 }
             }
         }
@@ -594,40 +934,89 @@ void WebsocketServerThread::process_payload(std::unique_ptr<std::pair<WebsocketO
             std::cerr << e.what() << '\n';
         }
     }
-    else if (payload->first == WebsocketOpcode::CLOSE)
+    else if (message.opcode == WebsocketOpcode::CLOSE)
     {
         this->yeet_flag = true;
     }
 }
 
-void WebsocketServerThread::on_audio_block(std::shared_ptr<AudioBlock> block)
+void WebsocketServerThread::on_audio_block(std::shared_ptr<AudioBroadcast> broadcast)
 {
-    nlohmann::json json;
-    json["audio_block"]["duration"] = block->duration;
-    json["audio_block"]["rate"] = block->sampling_rate;
-    json["audio_block"]["data"] = block->base64();
+    if (this->audio_started_ && broadcast->sequence <= this->last_sequence_)
+        return;
+    this->audio_started_ = true;
+    this->last_sequence_ = broadcast->sequence;
 
-    std::unique_ptr<std::vector<char>> buffer = get_websocket_frame_buffer(WebsocketOpcode::TEXT, json.dump(), true);
-    ssize_t result = write(this->connectionMetadata_->get(), buffer->data(), buffer->size());
-    if (result == -1)
+    std::shared_ptr<const std::vector<char>> buffer;
+    if (this->binary_audio_)
     {
-        if (errno == EPIPE)
-        {
-            std::cerr << "Broken pipe encountered" << std::endl;
-        }
-        else
+        buffer = broadcast->frame(AUDIO_FRAME_BINARY, [&broadcast]()
+                                  { return std::move(*get_websocket_frame_buffer(WebsocketOpcode::BINARY, get_binary_audio_payload(*broadcast), true)); });
+    }
+    else
+    {
+        // Compressed once per block with no context takeover, so every
+        // deflate listener shares the same bytes.
+        bool deflate = this->deflate_;
+        buffer = broadcast->frame(deflate ? AUDIO_FRAME_TEXT_JSON_DEFLATE : AUDIO_FRAME_TEXT_JSON, [&broadcast, deflate]()
+                                  {
+                                      auto block = broadcast->block;
+                                      nlohmann::json json;
+                                      json["audio_block"]["sequence"] = broadcast->sequence;
+                                      json["audio_block"]["timestamp"] = broadcast->timestamp;
+                                      json["audio_block"]["duration"] = block->duration;
+                                      json["audio_block"]["rate"] = block->sampling_rate;
+                                      json["audio_block"]["codec"] = block->codec_name();
+                                      json["audio_block"]["data"] = block->base64();
+                                      return std::move(*get_websocket_message_buffer(WebsocketOpcode::TEXT, json.dump(), deflate)); });
+    }
+
+    this->send_frame(buffer, broadcast->block->duration);
+}
+
+void WebsocketServerThread::on_queue_change(std::shared_ptr<QueueUpdate> update)
+{
+    std::unique_lock<std::mutex> lock(this->queue_mutex_);
+    if (update->snapshot)
+    {
+        if (this->queue_synced_ && update->version < this->queue_version_)
+            return;
+    }
+    else
+    {
+        // Deltas the snapshot already contains are skipped.
+        if (!this->queue_synced_ || update->version <= this->queue_version_)
+            return;
+        // One went missing, e.g. the shard overflowed: start over.
+        if (update->version != this->queue_version_ + 1)
         {
-            std::cerr << "Failed to write to socket: " << strerror(errno) << std::endl;
+            this->queue_synced_ = false;
+            this->request_snapshot();
+            return;
         }
-        this->yeet_flag = true;
     }
+    this->queue_synced_ = true;
+    this->queue_version_ = update->version;
+
+    bool deflate = this->deflate_;
+    auto buffer = update->frame(deflate ? QUEUE_FRAME_DEFLATE : QUEUE_FRAME_TEXT, [&update, deflate]()
+                                { return std::move(*get_websocket_message_buffer(WebsocketOpcode::TEXT, update->message.dump(), deflate)); });
+    this->send_frame(buffer);
 }
 
-void WebsocketServerThread::on_queue_change(nlohmann::json queue)
+// Called with queue_mutex_ held.
+void WebsocketServerThread::request_snapshot()
 {
-    unsigned long long buffer_size;
-    std::unique_ptr<std::vector<char>> buffer = get_websocket_frame_buffer(WebsocketOpcode::TEXT, queue.dump(), true);
-    write(this->connectionMetadata_->get(), buffer->data(), buffer->size());
+    auto station = this->queue_.lock();
+    if (station == nullptr)
+        return;
+
+    std::weak_ptr<WebsocketServerThread> self = this->shared_from_this();
+    station->get_queue().post([self](AudioQueue &queue)
+                              {
+                                  auto listener = self.lock();
+                                  if (listener != nullptr)
+                                      queue.send_snapshot(listener); });
 }
 
 #endif // !WEBSOCKET_SERVER_THREAD_H
\ No newline at end of file